@@ -129,11 +129,12 @@ namespace pbrt
 			primitiveInfo[i] = {i, primitives[i]->WorldBound()};
 		}
 		MemoryArena arena(1024 * 1024);
+		ConcurrentMemoryArena concurrentArena(1024 * 1024);
 		int totalNodes = 0;
 		std::vector<std::shared_ptr<Primitive>> orderedPrims;
 		BVHBuildNode* root;
 		if (splitMethod == SplitMethod::HLBVH)
-			root = HLBVHBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
+			root = HLBVHBuild(concurrentArena, primitiveInfo, &totalNodes, orderedPrims);
 		else
 			root = recursiveBuild(arena, primitiveInfo, 0, primitives.size(),
 			                      &totalNodes, orderedPrims);
@@ -319,7 +320,7 @@ namespace pbrt
 
 
 
-	BVHBuildNode* pbrt::BVHAccel::emitLBVH(BVHBuildNode*& buildNodes,
+	BVHBuildNode* pbrt::BVHAccel::emitLBVH(ConcurrentMemoryArena& arena,
 	                                       const std::vector<BVHPrimitiveInfo>& primitiveInfo,
 	                                       MortonPrimitive* mortonPrims, int nPrimitives, int* totalNodes,
 	                                       std::vector<std::shared_ptr<Primitive>>& orderedPrims,
@@ -328,7 +329,7 @@ namespace pbrt
 		if(bitIndex == -1 || nPrimitives < maxPrimsInNode)
 		{
 			(*totalNodes)++;
-			BVHBuildNode* node = buildNodes++;
+			BVHBuildNode* node = arena.Alloc<BVHBuildNode>(1, false);
 			Bounds3f bounds;
 			int firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
 			for (int i = 0; i < nPrimitives; ++i)
@@ -345,7 +346,7 @@ namespace pbrt
 			int mask = 1 << bitIndex;
 			if ((mortonPrims[0].mortonCode & mask) ==
 				(mortonPrims[nPrimitives - 1].mortonCode & mask))
-				return emitLBVH(buildNodes, primitiveInfo, mortonPrims, nPrimitives,
+				return emitLBVH(arena, primitiveInfo, mortonPrims, nPrimitives,
 				                totalNodes, orderedPrims, orderedPrimsOffset, bitIndex - 1);
 			int searchStart = 0, searchEnd = nPrimitives - 1;
 			while(searchStart + 1 != searchEnd)
@@ -359,12 +360,12 @@ namespace pbrt
 			}
 			int splitOffset = searchEnd;
 			(*totalNodes)++;
-			BVHBuildNode* node = buildNodes++;
+			BVHBuildNode* node = arena.Alloc<BVHBuildNode>(1, false);
 			BVHBuildNode* lbvh[2] = {
-		   emitLBVH(buildNodes, primitiveInfo, mortonPrims, splitOffset,
+		   emitLBVH(arena, primitiveInfo, mortonPrims, splitOffset,
 					totalNodes, orderedPrims, orderedPrimsOffset,
 					bitIndex - 1),
-		   emitLBVH(buildNodes, primitiveInfo, &mortonPrims[splitOffset],
+		   emitLBVH(arena, primitiveInfo, &mortonPrims[splitOffset],
 					nPrimitives - splitOffset, totalNodes, orderedPrims,
 					orderedPrimsOffset, bitIndex - 1) };
 			int axis = bitIndex % 3;
@@ -373,7 +374,7 @@ namespace pbrt
 		}
 	}
 
-	BVHBuildNode* BVHAccel::buildUpperSAH(MemoryArena& arena, std::vector<BVHBuildNode*>& treeletRoots,
+	BVHBuildNode* BVHAccel::buildUpperSAH(ConcurrentMemoryArena& arena, std::vector<BVHBuildNode*>& treeletRoots,
 		int start, int end, int* totalNodes) const
 	{
 		int nNodes = end - start;
@@ -456,7 +457,7 @@ namespace pbrt
 		return node;
 	}
 
-	BVHBuildNode* BVHAccel::HLBVHBuild(MemoryArena& arena, const std::vector<BVHPrimitiveInfo>& primitiveInfo,
+	BVHBuildNode* BVHAccel::HLBVHBuild(ConcurrentMemoryArena& arena, const std::vector<BVHPrimitiveInfo>& primitiveInfo,
 	                                   int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims) const
 	{
 		Bounds3f bounds;
@@ -482,26 +483,25 @@ namespace pbrt
 					(mortonPrims[end].mortonCode & mask)))
 			{
 				int nPrimitives = end - start;
-				int maxBVHNodes = 2 * nPrimitives - 1;
-				BVHBuildNode* nodes = arena.Alloc<BVHBuildNode>(maxBVHNodes, false);
-				treeletsToBuild.push_back({ start, nPrimitives, nodes });
+				treeletsToBuild.push_back({ start, nPrimitives, nullptr });
 				start = end;
 			}
-			std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
-			orderedPrims.resize(primitives.size());
-			ParallelFor(
-				[&](int i)
-				{
-					int nodesCreated = 0;
-					const int firstBitIndex = 29 - 12;
-					LBVHTreelet& tr = treeletsToBuild[i];
-					tr.buildNodes = emitLBVH(tr.buildNodes, primitiveInfo,
-						&mortonPrims[tr.startIndex], tr.nPrimitives,
-						&nodesCreated, orderedPrims, &orderedPrimsOffset, firstBitIndex);
-					atomicTotal += nodesCreated;
-				}, treeletsToBuild.size());
-			*totalNodes = atomicTotal;
 		}
+		// Treelet nodes come from the concurrent arena as they are emitted
+		std::atomic<int> atomicTotal(0), orderedPrimsOffset(0);
+		orderedPrims.resize(primitives.size());
+		ParallelFor(
+			[&](int i)
+			{
+				int nodesCreated = 0;
+				const int firstBitIndex = 29 - 12;
+				LBVHTreelet& tr = treeletsToBuild[i];
+				tr.buildNodes = emitLBVH(arena, primitiveInfo,
+					&mortonPrims[tr.startIndex], tr.nPrimitives,
+					&nodesCreated, orderedPrims, &orderedPrimsOffset, firstBitIndex);
+				atomicTotal += nodesCreated;
+			}, treeletsToBuild.size());
+		*totalNodes = atomicTotal;
 		std::vector<BVHBuildNode*> finishedTreelets;
 		for (LBVHTreelet& treelet : treeletsToBuild)
 			finishedTreelets.push_back(treelet.buildNodes);
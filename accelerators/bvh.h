@@ -27,16 +27,16 @@ namespace pbrt
 		                             std::vector<BVHPrimitiveInfo>& primitiveInfo,
 		                             int start, int end, int* totalNodes,
 		                             std::vector<std::shared_ptr<Primitive>>& orderedPrims);
-		BVHBuildNode* emitLBVH(BVHBuildNode*& buildNodes,
+		BVHBuildNode* emitLBVH(ConcurrentMemoryArena& arena,
 			const std::vector<BVHPrimitiveInfo>& primitiveInfo,
 			MortonPrimitive* mortonPrims, int nPrimitives, int* totalNodes,
 			std::vector<std::shared_ptr<Primitive>>& orderedPrims,
 			std::atomic<int>* orderedPrimsOffset, int bitIndex) const;
-		BVHBuildNode* buildUpperSAH(MemoryArena& arena,
+		BVHBuildNode* buildUpperSAH(ConcurrentMemoryArena& arena,
 			std::vector<BVHBuildNode*>& treeletRoots, int start, int end,
 			int* totalNodes) const;
 		int flattenBVHTree(BVHBuildNode* node, int* offset);
-		BVHBuildNode* HLBVHBuild(MemoryArena& arena,
+		BVHBuildNode* HLBVHBuild(ConcurrentMemoryArena& arena,
 		                         const std::vector<BVHPrimitiveInfo>& primitiveInfo,
 		                         int* totalNodes,
 		                         std::vector<std::shared_ptr<Primitive>>& orderedPrims) const;
@@ -6,58 +6,611 @@
 #include "spectrum.h"
 #include "interaction.h"
 #include "scene.h"
+#include "primitive.h"
+#include "reflection.h"
+#include "stats.h"
+#include "fileutil.h"
+#include "lightdistrib.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <shared_mutex>
 
 namespace pbrt
 {
+	STAT_COUNTER("Integrator/Tiles split at end of render", nTilesSplit);
+	STAT_COUNTER("Integrator/Pixels converged before all samples", nPixelsConverged);
+	STAT_COUNTER("Integrator/Checkpoints written", nCheckpoints);
+
+	// SamplerIntegrator Local Definitions
+	struct RenderTile
+	{
+		Bounds2i bounds;
+		int seed;
+		float cost = 0;
+		// Position in which deterministic renders merge the tile; set when
+		// the tile is popped, so only tiles that get rendered are numbered
+		int order = 0;
+	};
+
+	// Running mean and variance of the luminance of each pixel's samples,
+	// updated with Welford's method. Adaptive renders stop sampling a pixel
+	// once the standard error of its mean is small relative to the mean.
+	class PixelMoments
+	{
+	public:
+		explicit PixelMoments(const Bounds2i& bounds)
+			: bounds(bounds), moments(bounds.Area()) {}
+		void Add(const Point2i& p, float y)
+		{
+			Moments& m = moments[Offset(p)];
+			++m.n;
+			float delta = y - m.mean;
+			m.mean += delta / m.n;
+			m.m2 += delta * (y - m.mean);
+		}
+		// Adds the samples of _tile_, whose bounds lie inside ours, using
+		// the parallel form of Welford's update
+		void Merge(const PixelMoments& tile)
+		{
+			for (Point2i p : tile.bounds)
+			{
+				const Moments& b = tile.moments[tile.Offset(p)];
+				if (b.n == 0) continue;
+				Moments& a = moments[Offset(p)];
+				int64_t n = a.n + b.n;
+				float delta = b.mean - a.mean;
+				a.mean += delta * b.n / n;
+				a.m2 += b.m2 + delta * delta * a.n * b.n / n;
+				a.n = n;
+			}
+		}
+		void Save(std::vector<char>* data) const
+		{
+			AppendBytes(data, moments.data(), moments.size());
+		}
+		bool Load(const char** p, const char* end)
+		{
+			return ReadBytes(p, end, moments.data(), moments.size());
+		}
+		int64_t SampleCount(const Point2i& p) const { return moments[Offset(p)].n; }
+		float RelativeError(const Point2i& p) const
+		{
+			const Moments& m = moments[Offset(p)];
+			if (m.n < 2) return Infinity;
+			float variance = m.m2 / (m.n - 1);
+			return std::sqrt(variance / m.n) / std::max(m.mean, 1e-3f);
+		}
+	private:
+		struct Moments
+		{
+			int64_t n = 0;
+			float mean = 0, m2 = 0;
+		};
+		int Offset(const Point2i& p) const
+		{
+			return (p.y - bounds.pMin.y) * (bounds.pMax.x - bounds.pMin.x) +
+				(p.x - bounds.pMin.x);
+		}
+		const Bounds2i bounds;
+		std::vector<Moments> moments;
+	};
+
+	// Hands out tiles to the render threads. Once fewer tiles are left than
+	// there are threads, the tiles still pending are split into quadrants so
+	// that idle threads can help with the end of the frame.
+	class TileQueue
+	{
+	public:
+		TileQueue(std::vector<RenderTile> tiles, int nTiles, int nThreads,
+			bool allowSplit)
+			: tiles(tiles.begin(), tiles.end()), nTiles(nTiles),
+			  nThreads(nThreads), allowSplit(allowSplit) {}
+		bool Pop(RenderTile* tile)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tiles.empty()) return false;
+			*tile = tiles.front();
+			tiles.pop_front();
+			tile->order = nPopped++;
+			Vector2i extent = tile->bounds.Diagonal();
+			if (allowSplit && (int)tiles.size() < nThreads &&
+				extent.x >= 2 * MinTileSize && extent.y >= 2 * MinTileSize)
+			{
+				// Split _tile_ and queue the three quadrants we don't render
+				// Vector2i's operator/ divides by the reciprocal, which is 0 for ints
+				Point2i pMid = tile->bounds.pMin + Vector2i(extent.x / 2, extent.y / 2);
+				Bounds2i quads[4] = {
+					Bounds2i(tile->bounds.pMin, pMid),
+					Bounds2i(Point2i(pMid.x, tile->bounds.pMin.y),
+						Point2i(tile->bounds.pMax.x, pMid.y)),
+					Bounds2i(Point2i(tile->bounds.pMin.x, pMid.y),
+						Point2i(pMid.x, tile->bounds.pMax.y)),
+					Bounds2i(pMid, tile->bounds.pMax) };
+				// Child seeds land in a range no other tile uses. 16 pixel
+				// tiles split at most twice, so they stay below
+				// 21 * nTiles + 16, well under PassSeedStride.
+				int childSeed = nTiles + 4 * tile->seed;
+				for (int i = 3; i > 0; --i)
+					tiles.push_front({ quads[i], childSeed + i, tile->cost / 4 });
+				*tile = { quads[0], childSeed, tile->cost / 4, tile->order };
+				++nTilesSplit;
+			}
+			return true;
+		}
+	private:
+		static constexpr int MinTileSize = 4;
+		std::mutex mutex;
+		std::deque<RenderTile> tiles;
+		int nPopped = 0;
+		const int nTiles, nThreads;
+		const bool allowSplit;
+	};
+
+	// A rendered tile waiting to be added to the film
+	struct FinishedTile
+	{
+		int seed;
+		std::unique_ptr<FilmTile> filmTile;
+		// Sample moments of the tile's pixels, for adaptive renders
+		std::unique_ptr<PixelMoments> moments;
+		// Splats made while rendering the tile, which can land anywhere
+		std::vector<PendingSplat> splats;
+	};
+
+	// Merges tiles in increasing index order, whatever order they finish
+	// in, so that the film's floating-point sums do not depend on thread
+	// timing or thread count. Tiles must be handed out in index order with
+	// no gaps; WaitForTurn() holds back tiles more than _maxAhead_ past the
+	// next one to merge, so at most _maxAhead_ finished tiles wait in memory.
+	class OrderedTileMerger
+	{
+	public:
+		OrderedTileMerger(std::function<void(FinishedTile&)> merge, int maxAhead)
+			: merge(std::move(merge)), maxAhead(maxAhead) {}
+		void WaitForTurn(int index)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			merged.wait(lock, [&]() { return index < nextIndex + maxAhead; });
+		}
+		void Merge(int index, FinishedTile tile)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pending[index] = std::move(tile);
+				while (!pending.empty() && pending.begin()->first == nextIndex)
+				{
+					merge(pending.begin()->second);
+					pending.erase(pending.begin());
+					++nextIndex;
+				}
+			}
+			merged.notify_all();
+		}
+		bool Drained()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return pending.empty();
+		}
+	private:
+		std::function<void(FinishedTile&)> merge;
+		const int maxAhead;
+		std::mutex mutex;
+		std::condition_variable merged;
+		std::map<int, FinishedTile> pending;
+		int nextIndex = 0;
+	};
+
+	static const char checkpointMagic[8] = { 'P', 'B', 'R', 'T', 'C', 'K', 'P', 'T' };
+	static const uint32_t checkpointVersion = 1;
+
 	void SamplerIntegrator::Render(const Scene& scene)
 	{
 		Preprocess(scene, *sampler);
 		// Render image tiles in parallel
 		Bounds2i sampleBounds = camera->film->GetSampleBounds();
-		Vector2i sampleExtent = sampleBounds.Diagonal();
 		const int tileSize = 16;
-		Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
-			(sampleExtent.y + tileSize - 1) / tileSize);
-		ParallelFor2D([&](Point2i tile) {
-			// Allocate MemoryArena for tile
-			MemoryArena arena;
-			// Get sampler instance for tile
-			int seed = tile.y * nTiles.x + tile.x;
-			std::unique_ptr<Sampler> tileSampler(sampler->Clone(seed));
-			// Compute sample bounds for tile
-			int x0 = sampleBounds.pMin.x + tile.x * tileSize;
-			int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
-			int y0 = sampleBounds.pMin.y + tile.y * tileSize;
-			int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
-			Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
-			// Get FilmTile for tile
-			std::unique_ptr<FilmTile> filmTile = camera->film->GetFilmTile(tileBounds);
-			// Loop over pixels in tile to render them
-			for (auto pixel : tileBounds)
+		// Streaming films hold only a band of rows at a time, so the image is
+		// rendered band by band from the top; otherwise it is a single band
+		const int bandHeight = camera->film->GetBandHeight() > 0 ?
+			camera->film->GetBandHeight() : sampleBounds.Diagonal().y;
+		std::vector<std::vector<RenderTile>> bands;
+		int nTiles = 0;
+		for (int by = sampleBounds.pMin.y; by < sampleBounds.pMax.y; by += bandHeight)
+		{
+			int byEnd = std::min(by + bandHeight, sampleBounds.pMax.y);
+			std::vector<RenderTile> tiles;
+			for (int y0 = by; y0 < byEnd; y0 += tileSize)
+				for (int x0 = sampleBounds.pMin.x; x0 < sampleBounds.pMax.x; x0 += tileSize)
+				{
+					// Compute sample bounds for tile
+					int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+					int y1 = std::min(y0 + tileSize, byEnd);
+					tiles.push_back({ Bounds2i(Point2i(x0, y0), Point2i(x1, y1)), nTiles++ });
+				}
+			bands.push_back(std::move(tiles));
+		}
+
+		// Adaptive and time-budgeted renders take samples in passes of
+		// doubling size; adaptive passes cover only the pixels whose
+		// estimates have not converged yet
+		const bool adaptive = PbrtOptions.adaptiveThreshold > 0;
+		const bool progressive = adaptive || PbrtOptions.timeBudget > 0;
+		const int64_t spp = sampler->samplesPerPixel;
+		const int64_t minSamples = progressive ?
+			std::min(spp, std::max<int64_t>(4, spp / 16)) : spp;
+
+		const bool deterministic = PbrtOptions.deterministic;
+		Film* film = camera->film;
+		// Checkpoints record the film, the adaptive sample moments and which
+		// tiles of the current pass have been merged. Samples depend only on
+		// tile seeds and pass bounds, so a resumed render takes the same
+		// samples the interrupted one would have.
+		bool checkpointing = PbrtOptions.checkpointInterval > 0 || PbrtOptions.resume;
+		if (checkpointing && film->GetBandHeight() > 0)
+		{
+			Warning("Checkpoints are not supported by streaming films");
+			checkpointing = false;
+		}
+		const std::string checkpointFile = film->filename + ".checkpoint";
+		const uint8_t progressiveFlag = progressive ? 1 : 0;
+		// Merges take the lock shared; checkpoints take it exclusively so
+		// that they see no half-merged tiles
+		std::shared_mutex mergeMutex;
+		std::vector<uint8_t> tileMerged(nTiles, 0);
+		std::unique_ptr<PixelMoments> moments;
+		auto mergeTile = [&](FinishedTile& tile) {
+			std::shared_lock<std::shared_mutex> lock(mergeMutex);
+			film->MergeFilmTile(std::move(tile.filmTile));
+			if (tile.moments)
+				moments->Merge(*tile.moments);
+			// A tile's splats go in under the same lock as its pixels, so a
+			// checkpoint never counts a tile without its splats or the
+			// splats of a tile it doesn't count
+			film->MergeSplats(tile.splats);
+			if (checkpointing)
+				tileMerged[tile.seed] = 1;
+		};
+		const FilterSampler* filterSampler = film->GetFilterSampler();
+		const uint32_t aovMask = film->GetAOVMask();
+		// Progressive writes and checkpoints are claimed by whichever thread
+		// first finishes a tile after their interval has elapsed
+		using Clock = std::chrono::steady_clock;
+		const int64_t writeIntervalMs = int64_t(1000 * PbrtOptions.writeInterval);
+		std::atomic<int64_t> nextWriteMs(writeIntervalMs);
+		const int64_t checkpointIntervalMs = int64_t(1000 * PbrtOptions.checkpointInterval);
+		std::atomic<int64_t> nextCheckpointMs(checkpointIntervalMs);
+		// Keeps a slow checkpoint write from racing the next one
+		std::mutex checkpointFileMutex;
+		const Clock::time_point renderStart = Clock::now();
+		for (std::vector<RenderTile>& tiles : bands)
+		{
+			const Bounds2i bandBounds(Point2i(sampleBounds.pMin.x, tiles.front().bounds.pMin.y),
+				Point2i(sampleBounds.pMax.x, tiles.back().bounds.pMax.y));
+			// Bands of streaming films get a share of the time budget in
+			// proportion to their rows
+			const Clock::time_point deadline = renderStart +
+				std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+					double(PbrtOptions.timeBudget) * (bandBounds.pMax.y - sampleBounds.pMin.y) /
+					sampleBounds.Diagonal().y));
+			auto budgetSpent = [&]() {
+				return PbrtOptions.timeBudget > 0 && Clock::now() >= deadline;
+			};
+			// Schedule the most expensive tiles first. Deterministic renders keep
+			// grid order instead, which keeps few finished tiles waiting to merge.
+			if (!PbrtOptions.quickRender && !deterministic && tiles.size() > 1)
+			{
+				EstimateTileCosts(scene, &tiles);
+				std::stable_sort(tiles.begin(), tiles.end(),
+					[](const RenderTile& a, const RenderTile& b) { return a.cost > b.cost; });
+			}
+
+			if (adaptive)
+				moments.reset(new PixelMoments(bandBounds));
+			auto pixelActive = [&](const Point2i& p) {
+				return !moments || moments->SampleCount(p) < minSamples ||
+					moments->RelativeError(p) >= PbrtOptions.adaptiveThreshold;
+			};
+			int64_t passStart = 0;
+			auto saveCheckpoint = [&](std::vector<char>* data) {
+				data->insert(data->end(), checkpointMagic, checkpointMagic + 8);
+				AppendBytes(data, &checkpointVersion, 1);
+				AppendBytes(data, &sampleBounds.pMin, 1);
+				AppendBytes(data, &sampleBounds.pMax, 1);
+				AppendBytes(data, &spp, 1);
+				AppendBytes(data, &nTiles, 1);
+				AppendBytes(data, &progressiveFlag, 1);
+				AppendBytes(data, &PbrtOptions.adaptiveThreshold, 1);
+				AppendBytes(data, &passStart, 1);
+				AppendBytes(data, tileMerged.data(), tileMerged.size());
+				if (moments)
+					moments->Save(data);
+				film->SaveCheckpoint(data);
+			};
+			auto loadCheckpoint = [&](const char* p, const char* end) {
+				char magic[8];
+				uint32_t version;
+				Bounds2i bounds;
+				int64_t savedSpp;
+				int savedTiles;
+				uint8_t savedProgressive;
+				float threshold;
+				return ReadBytes(&p, end, magic, 8) &&
+					memcmp(magic, checkpointMagic, 8) == 0 &&
+					ReadBytes(&p, end, &version, 1) && version == checkpointVersion &&
+					ReadBytes(&p, end, &bounds.pMin, 1) &&
+					ReadBytes(&p, end, &bounds.pMax, 1) && bounds == sampleBounds &&
+					ReadBytes(&p, end, &savedSpp, 1) && savedSpp == spp &&
+					ReadBytes(&p, end, &savedTiles, 1) && savedTiles == nTiles &&
+					ReadBytes(&p, end, &savedProgressive, 1) &&
+					savedProgressive == progressiveFlag &&
+					ReadBytes(&p, end, &threshold, 1) &&
+					threshold == PbrtOptions.adaptiveThreshold &&
+					ReadBytes(&p, end, &passStart, 1) &&
+					ReadBytes(&p, end, tileMerged.data(), tileMerged.size()) &&
+					(!moments || moments->Load(&p, end)) &&
+					film->LoadCheckpoint(&p, end);
+			};
+			bool resumed = false;
+			if (checkpointing && PbrtOptions.resume)
+			{
+				std::vector<char> data;
+				if (!ReadFileContents(checkpointFile, &data))
+					Warning("No checkpoint \"%s\" to resume from; starting over",
+						checkpointFile.c_str());
+				else if (!loadCheckpoint(data.data(), data.data() + data.size()))
+				{
+					Warning("Checkpoint \"%s\" doesn't match this render; starting over",
+						checkpointFile.c_str());
+					passStart = 0;
+					std::fill(tileMerged.begin(), tileMerged.end(), 0);
+					if (moments)
+						moments.reset(new PixelMoments(bandBounds));
+				}
+				else
+					resumed = true;
+			}
+			while (passStart < spp)
+			{
+				const int64_t passEnd = std::min(spp, std::max(minSamples, 2 * passStart));
+				std::vector<RenderTile> passTiles;
+				int nResumedTiles = 0;
+				for (RenderTile tile : tiles)
+				{
+					// Tiles merged before a checkpoint are already in the film
+					if (resumed && tileMerged[tile.seed])
+					{
+						++nResumedTiles;
+						continue;
+					}
+					for (Point2i p : tile.bounds)
+						if (pixelActive(p))
+						{
+							passTiles.push_back(tile);
+							break;
+						}
+				}
+				resumed = false;
+				if ((passTiles.empty() && nResumedTiles == 0) || budgetSpent())
+					break;
+
+				// Splitting tiles would change their seeds depending on timing,
+				// and later passes and checkpoints need each pixel's samples
+				// from one seed
+				TileQueue queue(std::move(passTiles), nTiles, MaxThreadIndex(),
+					!deterministic && !progressive && !checkpointing);
+				// Each pass numbers its tiles from zero as they are popped; tiles
+				// left in the queue when the budget runs out leave no gap
+				OrderedTileMerger orderedMerger(mergeTile, 2 * MaxThreadIndex());
+				ParallelFor([&](int64_t) {
+					// Use this thread's pooled MemoryArena for all of its tiles
+					MemoryArena& arena = PerThreadArena();
+					RenderTile tile;
+					// Once the budget is spent, tiles still queued keep the
+					// samples of earlier passes
+					while (!budgetSpent() && queue.Pop(&tile))
+					{
+						if (deterministic)
+							orderedMerger.WaitForTurn(tile.order);
+						// Get sampler instance for tile
+						std::unique_ptr<Sampler> tileSampler(sampler->Clone(tile.seed));
+						Bounds2i tileBounds = tile.bounds;
+						// Get FilmTile for tile; the tile's moments are merged
+						// along with it
+						FinishedTile finished;
+						finished.seed = tile.seed;
+						finished.filmTile = film->GetFilmTile(tileBounds);
+						FilmTile* filmTile = finished.filmTile.get();
+						if (moments)
+							finished.moments.reset(new PixelMoments(tileBounds));
+						PixelMoments* tileMoments = finished.moments.get();
+						// Loop over pixels in tile to render them
+						for (auto pixel : tileBounds)
+						{
+							// Progressive passes seed each pixel by its position so
+							// that every pass draws from the same sample sets
+							if (progressive)
+							{
+								if (!pixelActive(pixel))
+									continue;
+								tileSampler->Reseed(uint64_t(pixel.y - sampleBounds.pMin.y) *
+									sampleBounds.Diagonal().x + (pixel.x - sampleBounds.pMin.x));
+							}
+							tileSampler->StartPixel(pixel);
+							if (!tileSampler->SetSampleNumber(passStart))
+								continue;
+							int64_t sampleIndex = passStart;
+							do
+							{
+								// Initialize CameraSample for current sample
+								CameraSample cameraSample =
+									tileSampler->GetCameraSample(pixel, filterSampler);
+								// Generate camera ray for current sample
+								RayDifferential ray;
+								float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+								ray.ScaleDifferentials(1 / std::sqrt(tileSampler->samplesPerPixel));
+								// Evaluate radiance along camera ray
+								Spectrum L(0.f);
+								AOVSample aov;
+								aov.requested = aovMask;
+								if (rayWeight > 0)
+									L = Li(ray, scene, *tileSampler, arena, 0,
+										aovMask ? &aov : nullptr);
+								if (aovMask)
+									filmTile->AddAOVSample(pixel, aov);
+								// Add camera rays contribution to image
+								if (filterSampler)
+								{
+									filmTile->AddPixelSample(pixel, L,
+										cameraSample.filterWeight, rayWeight);
+									if (tileMoments)
+										tileMoments->Add(pixel,
+											cameraSample.filterWeight * rayWeight * L.y());
+								}
+								else
+								{
+									filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+									if (tileMoments)
+										tileMoments->Add(pixel, rayWeight * L.y());
+								}
+								// Free MemoryArena memory from computing image sample value
+								arena.Reset();
+							} while (++sampleIndex < passEnd && tileSampler->StartNextSample());
+						}
+						finished.splats = film->TakeSplats();
+						// Merge image tile into Film
+						if (deterministic)
+							orderedMerger.Merge(tile.order, std::move(finished));
+						else
+							mergeTile(finished);
+						int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+							Clock::now() - renderStart).count();
+						if (writeIntervalMs > 0)
+						{
+							int64_t dueMs = nextWriteMs;
+							if (elapsedMs >= dueMs &&
+								nextWriteMs.compare_exchange_strong(dueMs, elapsedMs + writeIntervalMs))
+								film->WriteImageAsync();
+						}
+						if (checkpointing && checkpointIntervalMs > 0)
+						{
+							int64_t dueMs = nextCheckpointMs;
+							if (elapsedMs >= dueMs &&
+								nextCheckpointMs.compare_exchange_strong(dueMs, elapsedMs + checkpointIntervalMs))
+							{
+								// Serialize with merges stopped, then write the file
+								// while rendering continues
+								std::lock_guard<std::mutex> fileLock(checkpointFileMutex);
+								std::vector<char> data;
+								{
+									std::unique_lock<std::shared_mutex> lock(mergeMutex);
+									saveCheckpoint(&data);
+								}
+								if (WriteFileAtomic(checkpointFile, data))
+									++nCheckpoints;
+								else
+									Warning("Couldn't write checkpoint \"%s\"", checkpointFile.c_str());
+							}
+						}
+					}
+					}, MaxThreadIndex());
+				assert(orderedMerger.Drained());
+				// Take the lock so that a checkpoint never pairs the new pass
+				// with the old pass's merged tiles
+				{
+					std::unique_lock<std::shared_mutex> lock(mergeMutex);
+					passStart = passEnd;
+					std::fill(tileMerged.begin(), tileMerged.end(), 0);
+				}
+				if (PbrtOptions.writePasses && passStart < spp)
+					film->WriteImageAsync();
+			}
+			if (moments)
+				for (Point2i p : bandBounds)
+					if (moments->SampleCount(p) < spp)
+						++nPixelsConverged;
+			film->FinishRows(bandBounds.pMax.y);
+		}
+		film->WriteImage();
+		// The image is complete, so there is nothing left to resume
+		if (checkpointing)
+			std::remove(checkpointFile.c_str());
+	}
+
+	void SamplerIntegrator::EstimateTileCosts(const Scene& scene,
+		std::vector<RenderTile>* tiles) const
+	{
+		// Time a sparse one-sample-per-pixel pass over each tile; the result
+		// only orders the tiles and is not added to the image
+		const int stride = 4;
+		int nTiles = int(tiles->size());
+		ParallelFor([&](int64_t t) {
+			RenderTile& tile = (*tiles)[t];
+			MemoryArena& arena = PerThreadArena();
+			std::unique_ptr<Sampler> tileSampler(
+				sampler->Clone(PassSeed(TileCostPass, tile.seed)));
+			auto start = std::chrono::steady_clock::now();
+			for (int y = tile.bounds.pMin.y; y < tile.bounds.pMax.y; y += stride)
+				for (int x = tile.bounds.pMin.x; x < tile.bounds.pMax.x; x += stride)
+				{
+					Point2i pixel(x, y);
+					tileSampler->StartPixel(pixel);
+					CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
+					RayDifferential ray;
+					if (camera->GenerateRayDifferential(cameraSample, &ray) > 0)
+						Li(ray, scene, *tileSampler, arena);
+					arena.Reset();
+				}
+			auto elapsed = std::chrono::steady_clock::now() - start;
+			camera->film->TakeSplats();
+			tile.cost = std::chrono::duration<float>(elapsed).count();
+			}, nTiles);
+	}
+
+	void SamplerIntegrator::AuxiliaryPass(const Scene& scene, Sampler& sampler,
+		int pass, int spp,
+		const std::function<void(const Point2i&, const Spectrum&)>& record) const
+	{
+		const Bounds2i sampleBounds = camera->film->GetSampleBounds();
+		const int tileSize = 16;
+		const Point2i nTiles((sampleBounds.Diagonal().x + tileSize - 1) / tileSize,
+			(sampleBounds.Diagonal().y + tileSize - 1) / tileSize);
+		const int nPassTiles = nTiles.x * nTiles.y;
+		auto renderTile = [&](int64_t t) {
+			MemoryArena& arena = PerThreadArena();
+			Point2i p0(sampleBounds.pMin.x + int(t % nTiles.x) * tileSize,
+				sampleBounds.pMin.y + int(t / nTiles.x) * tileSize);
+			Bounds2i tileBounds(p0, Point2i(std::min(p0.x + tileSize, sampleBounds.pMax.x),
+				std::min(p0.y + tileSize, sampleBounds.pMax.y)));
+			std::unique_ptr<Sampler> tileSampler(sampler.Clone(PassSeed(pass, int(t))));
+			for (Point2i pixel : tileBounds)
 			{
 				tileSampler->StartPixel(pixel);
+				int sampleIndex = 0;
 				do
 				{
-					// Initialize CameraSample for current sample
 					CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
-					// Generate camera ray for current sample
 					RayDifferential ray;
 					float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
-					ray.ScaleDifferentials(1 / std::sqrt(tileSampler->samplesPerPixel));
-					// Evaluate radiance along camera ray
-					Spectrum L(0.f);
 					if (rayWeight > 0)
-						L = Li(ray, scene, *tileSampler, arena);
-					// Add camera rays contribution to image
-					filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
-					// Free MemoryArena memory from computing image sample value
+					{
+						ray.ScaleDifferentials(1 / std::sqrt(float(spp)));
+						record(pixel, rayWeight * Li(ray, scene, *tileSampler, arena));
+					}
 					arena.Reset();
-				} while (tileSampler->StartNextSample());
+				} while (++sampleIndex < spp && tileSampler->StartNextSample());
 			}
-			// Merge image tile into Film
-			camera->film->MergeFilmTile(std::move(filmTile));
-			}, nTiles);
-		camera->film->WriteImage();
+			// The pass's samples aren't part of the image, so neither are
+			// their splats
+			camera->film->TakeSplats();
+		};
+		if (PbrtOptions.deterministic)
+			for (int t = 0; t < nPassTiles; ++t)
+				renderTile(t);
+		else
+			ParallelFor(renderTile, nPassTiles);
 	}
 
 	Spectrum SamplerIntegrator::SpecularReflect(const RayDifferential& ray, const SurfaceInteraction& isect, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const
@@ -124,13 +677,54 @@ namespace pbrt
 	{
 		int nLights = int(scene.lights.size());
 		if (nLights == 0) return { 0 };
-		int lightNum = std::min((int)(sampler.Get1D() * nLights), nLights - 1);
+		int lightNum;
+		float lightPdf;
+		if (lightDistrib)
+			lightNum = lightDistrib->SampleDiscrete(sampler.Get1D(), &lightPdf);
+		else
+		{
+			lightNum = std::min((int)(sampler.Get1D() * nLights), nLights - 1);
+			lightPdf = 1.f / nLights;
+		}
+		// Draw the light's samples even if it can't be used, so that every
+		// path consumes the same sample dimensions
+		Point2f uLight = sampler.Get2D();
+		Point2f uScattering = sampler.Get2D();
+		if (lightPdf == 0) return { 0 };
 		const std::shared_ptr<Light>& light = scene.lights[lightNum];
+		return EstimateDirect(it, uScattering, *light, uLight, scene, sampler,
+			arena, handleMedia) / lightPdf;
+	}
+
+	Spectrum UniformSampleOneLight(const Interaction& it, const Scene& scene, MemoryArena& arena, Sampler& sampler, const LightDistribution& lightDistrib, bool handleMedia)
+	{
+		// Distributions built for a scene without lights are empty
+		if (scene.lights.empty()) return { 0 };
+		float lightPdf;
+		int lightNum = lightDistrib.Sample(it.p, it.n, sampler.Get1D(), &lightPdf);
 		Point2f uLight = sampler.Get2D();
 		Point2f uScattering = sampler.Get2D();
-		return (float)nLights *
-			EstimateDirect(it, uScattering, *light, uLight, scene, sampler,
-				arena, handleMedia);
+		if (lightNum < 0 || lightPdf == 0) return { 0 };
+		return EstimateDirect(it, uScattering, *scene.lights[lightNum], uLight, scene,
+			sampler, arena, handleMedia) / lightPdf;
+	}
+
+	void RecordAOVSample(AOVSample* aov, const Point3f& rayOrigin,
+		const SurfaceInteraction& isect)
+	{
+		if (!aov || aov->hit)
+			return;
+		aov->hit = true;
+		aov->depth = Distance(rayOrigin, isect.p);
+		aov->n = isect.shading.n;
+		aov->primitiveId = isect.primitive ? isect.primitive->GetPrimitiveId() : -1;
+		if (isect.bsdf && (aov->requested & AOVBit(AOV::Albedo)))
+		{
+			// Estimate albedo with a fixed pattern, leaving the sampler alone
+			const Point2f u[4] = { Point2f(.25f, .25f), Point2f(.75f, .25f),
+			                       Point2f(.25f, .75f), Point2f(.75f, .75f) };
+			aov->albedo = isect.bsdf->rho(isect.wo, 4, u);
+		}
 	}
 
 	Spectrum EstimateDirect(const Interaction& it, const Point2f& uScattering, const Light& light, const Point2f& uLight, const Scene& scene, Sampler& sampler, MemoryArena& arena, bool handleMedia, bool specular)
@@ -1,6 +1,7 @@
 #ifndef PBRT_CORE_INTEGRATOR_H
 #define PBRT_CORE_INTEGRATOR_H
 
+#include <functional>
 #include <utility>
 #include "spectrum.h"
 #include "sampling.h"
@@ -8,6 +9,8 @@
 
 namespace pbrt
 {
+	struct RenderTile;
+
 	Spectrum UniformSampleAllLights(const Interaction& it, const Scene& scene,
 	                                MemoryArena& arena, Sampler& sampler,
 	                                const std::vector<int>& nLightSamples,
@@ -16,16 +19,38 @@ namespace pbrt
 	                               MemoryArena& arena, Sampler& sampler,
 	                               bool handleMedia = false,
 	                               const Distribution1D* lightDistrib = nullptr);
+	// Picks the light with _lightDistrib_ at the shading point
+	Spectrum UniformSampleOneLight(const Interaction& it, const Scene& scene,
+	                               MemoryArena& arena, Sampler& sampler,
+	                               const LightDistribution& lightDistrib,
+	                               bool handleMedia = false);
 
 	Spectrum EstimateDirect(const Interaction& it,
 		const Point2f& uScattering, const Light& light,
 		const Point2f& uLight, const Scene& scene, Sampler& sampler,
 		MemoryArena& arena, bool handleMedia = false, bool specular = false);
 
+	// Fills in _aov_ from the first surface a camera ray hits; later calls
+	// for the same sample are ignored
+	void RecordAOVSample(AOVSample* aov, const Point3f& rayOrigin,
+		const SurfaceInteraction& isect);
+
+	// The image's tiles and the quadrants they are split into take sampler
+	// seeds below PassSeedStride. Passes whose samples are not added to the
+	// image take theirs from PassSeed(), each pass from a range of its own.
+	constexpr int PassSeedStride = 1 << 24;
+	// Training pass i of the guided path integrator uses
+	// GuidedTrainingPass + i, so that entry stays last
+	enum { TileCostPass = 0, PathPrepass, GuidedTrainingPass };
+	inline int PassSeed(int pass, int index)
+	{
+		return (pass + 1) * PassSeedStride + index;
+	}
+
 	class Integrator
 	{
 	public:
-		~Integrator() {}
+		virtual ~Integrator() {}
 		virtual void Render(const Scene &scene) = 0;
 	};
 	class SamplerIntegrator: public Integrator
@@ -37,7 +62,8 @@ namespace pbrt
 		void Render(const Scene& scene) override;
 		virtual void Preprocess(const Scene& scene, Sampler& sampler);
 		virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
-			Sampler& sampler, MemoryArena& arena, int depth = 0) const = 0;
+			Sampler& sampler, MemoryArena& arena, int depth = 0,
+			AOVSample* aov = nullptr) const = 0;
 		Spectrum SpecularReflect(const RayDifferential& ray,
 			const SurfaceInteraction& isect,
 			const Scene& scene, Sampler& sampler,
@@ -48,8 +74,17 @@ namespace pbrt
 			MemoryArena& arena, int depth) const;
 
 	protected:
-	private:
+		void EstimateTileCosts(const Scene& scene,
+			std::vector<RenderTile>* tiles) const;
+		// Takes _spp_ samples in every pixel with samplers seeded by
+		// PassSeed(_pass_, tile) and hands each sample's weighted radiance to
+		// _record_ instead of the image. Deterministic renders take the
+		// tiles in order on the calling thread, so that whatever _record_
+		// accumulates doesn't depend on thread timing.
+		void AuxiliaryPass(const Scene& scene, Sampler& sampler, int pass, int spp,
+			const std::function<void(const Point2i&, const Spectrum&)>& record) const;
 		std::shared_ptr<const Camera> camera;
+	private:
 		std::shared_ptr<Sampler> sampler;
 		
 	};
@@ -33,7 +33,10 @@
 #include "filters/triangle.h"
 
 #include "textures/imagemap.h"
+#include "integrators/guidedpath.h"
 #include "integrators/path.h"
+#include "integrators/sppm.h"
+#include "integrators/wavefront.h"
 #include "cameras/perspective.h"
 #include "textures/scale.h"
 #include "samplers/stratified.h"
@@ -908,6 +911,12 @@ do { if (curTransform.IsAnimated())                                   \
 
         if (IntegratorName == "path")
             integrator = CreatePathIntegrator(IntegratorParams, sampler, camera);
+        else if (IntegratorName == "wavefront")
+            integrator = CreateWavefrontPathIntegrator(IntegratorParams, sampler, camera);
+        else if (IntegratorName == "guidedpath")
+            integrator = CreateGuidedPathIntegrator(IntegratorParams, sampler, camera);
+        else if (IntegratorName == "sppm")
+            integrator = CreateSPPMIntegrator(IntegratorParams, sampler, camera);
 
         IntegratorParams.ReportUnused();
         // Warn if no light sources are defined
@@ -26,6 +26,8 @@ namespace pbrt
 		Point2f pFilm;
 		Point2f pLens;
 		float time;
+		// Weight of the sample when _pFilm_ was drawn from the filter
+		float filterWeight = 1;
 	};
 
 	class ProjectiveCamera :public Camera
@@ -0,0 +1,179 @@
+#include "denoise.h"
+
+#include "parallel.h"
+
+namespace pbrt
+{
+	// exp(x) for x <= 0 to within 1% wherever it doesn't underflow,
+	// without calls or compares so that the filter's loop vectorizes
+	static inline float ExpNonPositive(float x)
+	{
+		// Keep x above -1e6, changing much only values whose exponentials
+		// underflow anyway
+		x = x / (1 - 1e-6f * x) * 1.442695041f;
+		// 2^x = 2^i 2^f with integer i and f in [-1/2, 1/2]; adding 1.5 2^23
+		// rounds x to an integer and leaves it in the low mantissa bits
+		float t = x + 12582912.f;
+		float f = (x - (t - 12582912.f)) * .6931471806f;
+		int32_t i;
+		std::memcpy(&i, &t, sizeof(float));
+		i = std::max(i - 0x4b400000, -126);
+		float p = 1 + f * (1 + f * (1.f / 2 + f * (1.f / 6 + f * (1.f / 24 + f * (1.f / 120)))));
+		int32_t bits = (i + 127) << 23;
+		float scale;
+		std::memcpy(&scale, &bits, sizeof(float));
+		return p * scale;
+	}
+
+	void DenoiseImage(const float* rgb, int width, int height,
+		const DenoiseGuides& guides, const DenoiseOptions& options, float* result)
+	{
+		// The image and its guides are split into planes, so that the
+		// filter's inner loop runs over contiguous floats. Missing guides
+		// are left constant, which turns their terms off.
+		// The planes are padded by a block, so that the filter can read
+		// whole blocks at the end of the last row
+		constexpr int blockSize = 8;
+		const int nPixels = width * height;
+		const int planeSize = nPixels + blockSize;
+		std::vector<float> color[3], filtered[3], albedo[3], normal[3], depth(planeSize, 0.f);
+		for (int c = 0; c < 3; ++c)
+		{
+			color[c].assign(planeSize, 0.f);
+			filtered[c].assign(planeSize, 0.f);
+			albedo[c].assign(planeSize, 1.f);
+			normal[c].assign(planeSize, 0.f);
+		}
+		ParallelFor([&](int64_t y) {
+			for (int i = y * width; i < (y + 1) * width; ++i)
+			{
+				// Pixels without an albedo, such as the background, aren't
+				// demodulated, and dark albedos are clamped so that dividing
+				// by them doesn't amplify noise
+				if (guides.albedo && (guides.albedo[3 * i] > 0 ||
+					guides.albedo[3 * i + 1] > 0 || guides.albedo[3 * i + 2] > 0))
+					for (int c = 0; c < 3; ++c)
+						albedo[c][i] = std::max(guides.albedo[3 * i + c], .01f);
+				for (int c = 0; c < 3; ++c)
+					color[c][i] = rgb[3 * i + c] / albedo[c][i];
+				if (guides.normal)
+				{
+					const float* n = &guides.normal[3 * i];
+					float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+					if (length > 0)
+						for (int c = 0; c < 3; ++c)
+							normal[c][i] = n[c] / length;
+				}
+				if (guides.depth && std::isfinite(guides.depth[i]))
+					depth[i] = guides.depth[i];
+			}
+		}, height, 8);
+
+		// Color differences are relative to the pixels' luminance, with a
+		// floor so that nearly black regions are still smoothed
+		double sumY = 0;
+		for (int i = 0; i < nPixels; ++i)
+			sumY += .2126f * color[0][i] + .7152f * color[1][i] + .0722f * color[2][i];
+		const float minY = std::max(.01f * float(sumY / std::max(nPixels, 1)), 1e-4f);
+		const float minY2 = minY * minY;
+
+		const float kernel[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+		const float invSigmaAlbedo2 = 1 / (options.sigmaAlbedo * options.sigmaAlbedo);
+		for (int iteration = 0; iteration < options.iterations; ++iteration)
+		{
+			const int step = 1 << iteration;
+			const float sigmaColor = options.sigmaColor / step;
+			const float invSigmaColor2 = 1 / (sigmaColor * sigmaColor);
+			ParallelFor([&](int64_t y) {
+				float* sums = ALLOCA(float, 4 * width);
+				std::fill(sums, sums + 4 * width, 0.f);
+				float* sumR = sums;
+				float* sumG = sums + width;
+				float* sumB = sums + 2 * width;
+				float* sumW = sums + 3 * width;
+				const int row = y * width;
+				const float *ri = &color[0][row], *gi = &color[1][row], *bi = &color[2][row];
+				const float *nxi = &normal[0][row], *nyi = &normal[1][row], *nzi = &normal[2][row];
+				const float *ari = &albedo[0][row], *agi = &albedo[1][row], *abi = &albedo[2][row];
+				const float* zi = &depth[row];
+				for (int ky = -2; ky <= 2; ++ky)
+				{
+					const int yy = y + ky * step;
+					if (yy < 0 || yy >= height)
+						continue;
+					for (int kx = -2; kx <= 2; ++kx)
+					{
+						// Taps that fall outside the image are skipped
+						const int dx = kx * step;
+						const int x0 = std::max(0, -dx), x1 = std::min(width, width - dx);
+						const int rowj = yy * width;
+						const float *rj = &color[0][rowj], *gj = &color[1][rowj], *bj = &color[2][rowj];
+						const float *nxj = &normal[0][rowj], *nyj = &normal[1][rowj], *nzj = &normal[2][rowj];
+						const float *arj = &albedo[0][rowj], *agj = &albedo[1][rowj], *abj = &albedo[2][rowj];
+						const float* zj = &depth[rowj];
+						const float h = kernel[ky + 2] * kernel[kx + 2];
+						// Depth may change in proportion to the tap's distance
+						const float sigmaDepth = options.sigmaDepth *
+							std::max(1.f, step * std::sqrt(float(kx * kx + ky * ky)));
+						const float invSigmaDepth2 = 1 / (sigmaDepth * sigmaDepth);
+						for (int x = x0; x < x1; x += blockSize)
+						{
+							// Weights go to a local array, which the compiler
+							// knows the planes don't alias, so the loop
+							// vectorizes. Lanes past _x1_ read the planes'
+							// padding or the next row and are dropped.
+							float w[blockSize];
+							for (int i = 0; i < blockSize; ++i)
+							{
+								const int xi = x + i, xj = xi + dx;
+								float dr = ri[xi] - rj[xj], dg = gi[xi] - gj[xj], db = bi[xi] - bj[xj];
+								float Yi = .2126f * ri[xi] + .7152f * gi[xi] + .0722f * bi[xi];
+								float Yj = .2126f * rj[xj] + .7152f * gj[xj] + .0722f * bj[xj];
+								float eColor = (dr * dr + dg * dg + db * db) * invSigmaColor2 /
+									(.5f * (Yi * Yi + Yj * Yj) + minY2);
+								// Cosine between the normals; two pixels without
+								// normals match, and one with and one without don't
+								float ni2 = nxi[xi] * nxi[xi] + nyi[xi] * nyi[xi] + nzi[xi] * nzi[xi];
+								float nj2 = nxj[xj] * nxj[xj] + nyj[xj] * nyj[xj] + nzj[xj] * nzj[xj];
+								float cosNormal = nxi[xi] * nxj[xj] + nyi[xi] * nyj[xj] +
+									nzi[xi] * nzj[xj] + (1 - ni2) * (1 - nj2);
+								// exp(-p (1 - cos)) is close to cos^p near 1
+								float eNormal = options.normalPower * (1 - cosNormal);
+								float dz = (zi[xi] - zj[xj]) / (zi[xi] + 1e-4f);
+								float eDepth = dz * dz * invSigmaDepth2;
+								float dar = ari[xi] - arj[xj], dag = agi[xi] - agj[xj],
+									dab = abi[xi] - abj[xj];
+								float eAlbedo = (dar * dar + dag * dag + dab * dab) * invSigmaAlbedo2;
+								w[i] = h * ExpNonPositive(-(eColor + eNormal + eDepth + eAlbedo));
+							}
+							const int count = std::min(blockSize, x1 - x);
+							for (int i = 0; i < count; ++i)
+							{
+								sumR[x + i] += w[i] * rj[x + i + dx];
+								sumG[x + i] += w[i] * gj[x + i + dx];
+								sumB[x + i] += w[i] * bj[x + i + dx];
+								sumW[x + i] += w[i];
+							}
+						}
+					}
+				}
+				// The center tap always has a nonzero weight
+				for (int x = 0; x < width; ++x)
+				{
+					float invW = 1 / sumW[x];
+					filtered[0][row + x] = sumR[x] * invW;
+					filtered[1][row + x] = sumG[x] * invW;
+					filtered[2][row + x] = sumB[x] * invW;
+				}
+			}, height, 8);
+			for (int c = 0; c < 3; ++c)
+				std::swap(color[c], filtered[c]);
+		}
+
+		ParallelFor([&](int64_t y) {
+			for (int i = y * width; i < (y + 1) * width; ++i)
+				for (int c = 0; c < 3; ++c)
+					result[3 * i + c] = color[c][i] * albedo[c][i];
+		}, height, 8);
+	}
+}
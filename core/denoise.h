@@ -0,0 +1,42 @@
+#ifndef PBRT_CORE_DENOISE_H
+#define PBRT_CORE_DENOISE_H
+
+#include "pbrt.h"
+
+namespace pbrt
+{
+	// Per-pixel guide images for DenoiseImage(), in the layout of the
+	// image itself. Albedo and normals are RGB and XYZ triples; pixels
+	// whose camera rays hit nothing have zero normals. Missing guides are
+	// left null and ignored.
+	struct DenoiseGuides
+	{
+		const float* albedo = nullptr;
+		const float* normal = nullptr;
+		const float* depth = nullptr;
+	};
+
+	struct DenoiseOptions
+	{
+		// Filter passes; pass i samples taps 2^i pixels apart
+		int iterations = 5;
+		// Width of the edge-stopping functions: relative color difference,
+		// halved every pass; exponent applied to the cosine between
+		// normals; relative depth difference per pixel of tap distance;
+		// albedo difference
+		float sigmaColor = 16.f;
+		float normalPower = 64.f;
+		float sigmaDepth = .02f;
+		float sigmaAlbedo = .1f;
+	};
+
+	// Edge-avoiding a-trous wavelet filter. The image is divided by the
+	// albedo, filtered with a widening 5x5 B-spline kernel whose weights
+	// fall off across color, normal, depth and albedo edges, and
+	// multiplied by the albedo again, so texture detail isn't blurred.
+	// _rgb_ and _result_ hold interleaved RGB and may be the same.
+	void DenoiseImage(const float* rgb, int width, int height,
+		const DenoiseGuides& guides, const DenoiseOptions& options, float* result);
+}
+
+#endif
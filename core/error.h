@@ -1,28 +1,39 @@
 #ifndef PBRT_CORE_ERROR_H
 #define PBRT_CORE_ERROR_H
 #include "fmt/core.h"
+#include <cstdio>
+#include <string>
 
 namespace pbrt
 {
+	// Expands a printf-style message
+	template <typename... T>
+	std::string StringPrintf(const char* format, T&&... args)
+	{
+		int size = snprintf(nullptr, 0, format, args...);
+		if (size <= 0)
+			return std::string();
+		std::string str(size, '\0');
+		snprintf(&str[0], size + 1, format, args...);
+		return str;
+	}
+
 	template <typename... T>
 	void Info(const char* format, T&&... args)
 	{
-		fmt::print("Info: ");
-		//fmt::print((std::string)format, &args...);
+		fmt::print("Info: {}\n", StringPrintf(format, args...));
 	}
 
 	template <typename... T>
 	void Warning(const char* format, T&&... args)
 	{
-		fmt::print("Warning: ");
-		//fmt::print((std::string)format, &args...);
+		fmt::print("Warning: {}\n", StringPrintf(format, args...));
 	}
 	
 	template <typename... T>
 	void Error(const char* format, T&&... args)
 	{
-		fmt::print("Error: ");
-		//fmt::print((std::string)format, &args...);
+		fmt::print("Error: {}\n", StringPrintf(format, args...));
 	}
 
 }
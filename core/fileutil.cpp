@@ -1,8 +1,14 @@
 #include "fileutil.h"
+#include <cstdio>
 #include <cstdlib>
 #include <climits>
-#ifndef PBRT_IS_WINDOWS
+#include <filesystem>
+#ifdef PBRT_IS_WINDOWS
+#include <io.h>
+#else
+#include <fcntl.h>
 #include <libgen.h>
+#include <unistd.h>
 #endif
 
 namespace pbrt {
@@ -92,4 +98,57 @@ std::string DirectoryContaining(const std::string &filename) {
         searchDirectory = dirname;
     }
 
+    // Waits until _f_'s data has reached the disk, not just the OS
+    static bool SyncFile(FILE *f) {
+#ifdef PBRT_IS_WINDOWS
+        return _commit(_fileno(f)) == 0;
+#else
+        return fsync(fileno(f)) == 0;
+#endif
+    }
+
+    // On POSIX systems a rename is only durable once the directory holding
+    // the file has been synced too; Windows has no equivalent
+    static void SyncDirectoryContaining(const std::string &filename) {
+#ifndef PBRT_IS_WINDOWS
+        int fd = open(DirectoryContaining(filename).c_str(), O_RDONLY);
+        if (fd < 0) return;
+        fsync(fd);
+        close(fd);
+#endif
+    }
+
+    bool WriteFileAtomic(const std::string &filename, const std::vector<char> &data) {
+        std::string tmpName = filename + ".tmp";
+        FILE *f = fopen(tmpName.c_str(), "wb");
+        if (!f) return false;
+        bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+        ok = fflush(f) == 0 && ok;
+        // Otherwise a system crash after the rename can leave the new name
+        // pointing at a file whose data was never written
+        ok = ok && SyncFile(f);
+        ok = fclose(f) == 0 && ok;
+        std::error_code err;
+        if (ok) std::filesystem::rename(tmpName, filename, err);
+        if (!ok || err) {
+            std::remove(tmpName.c_str());
+            return false;
+        }
+        SyncDirectoryContaining(filename);
+        return true;
+    }
+
+    bool ReadFileContents(const std::string &filename, std::vector<char> *data) {
+        FILE *f = fopen(filename.c_str(), "rb");
+        if (!f) return false;
+        data->clear();
+        char buf[65536];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            data->insert(data->end(), buf, buf + n);
+        bool ok = !ferror(f);
+        fclose(f);
+        return ok;
+    }
+
 } 
\ No newline at end of file
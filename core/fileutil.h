@@ -3,6 +3,7 @@
 
 #include "pbrt.h"
 #include <string>
+#include <vector>
 #include <cctype>
 #include <string.h>
 
@@ -22,5 +23,27 @@ namespace pbrt {
                 [](char a, char b) { return std::tolower(a) == std::tolower(b); });
     }
 
+    // Whole-file binary I/O. WriteFileAtomic() writes to a temporary file
+    // next to _filename_, syncs it to disk and renames it into place, so
+    // that neither a killed process nor a system crash leaves a partially
+    // written file behind.
+    bool WriteFileAtomic(const std::string &filename, const std::vector<char> &data);
+    bool ReadFileContents(const std::string &filename, std::vector<char> *data);
+
+    // Raw values in binary files that are only read back by the same build
+    template <typename T>
+    void AppendBytes(std::vector<char> *buf, const T *v, size_t n) {
+        const char *p = reinterpret_cast<const char *>(v);
+        buf->insert(buf->end(), p, p + n * sizeof(T));
+    }
+
+    template <typename T>
+    bool ReadBytes(const char **p, const char *end, T *v, size_t n) {
+        if (size_t(end - *p) < n * sizeof(T)) return false;
+        memcpy(v, *p, n * sizeof(T));
+        *p += n * sizeof(T);
+        return true;
+    }
+
 }
 #endif
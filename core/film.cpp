@@ -1,20 +1,77 @@
 #include "film.h"
 
+#include "denoise.h"
+#include "fileutil.h"
 #include "imageio.h"
 #include "paramset.h"
+#include "stats.h"
 
 namespace pbrt
 {
 	Film::Film(const Point2i& resolution, const Bounds2f& cropWindow, std::unique_ptr<Filter> filt, float diagonal,
-	           const std::string& filename, float scale, float maxSampleLuminance)
+	           const std::string& filename, float scale, float maxSampleLuminance,
+	           bool filterSampling, bool halfOutput, uint32_t aovMask, int bandHeight,
+	           const std::string& denoisedFilename)
 		: fullResolution(resolution), diagonal(diagonal), filter(std::move(filt)),
 		  filename(filename),
 		  croppedPixelBounds(Point2i(std::ceil(fullResolution.x * cropWindow.pMin.x),
 		                             std::ceil(fullResolution.y * cropWindow.pMin.y)),
 		                     Point2i(std::ceil(fullResolution.x * cropWindow.pMax.x),
 		                             std::ceil(fullResolution.y * cropWindow.pMax.y))),
-		  scale(scale), pixels(std::unique_ptr<Pixel[]>(new Pixel[croppedPixelBounds.Area()]))
+		  scale(scale), halfOutput(halfOutput), denoisedFilename(denoisedFilename)
 	{
+		// A streaming film keeps a ring of rows that covers one band of
+		// samples plus the filter's reach on either side
+		const int width = croppedPixelBounds.Diagonal().x;
+		const int height = croppedPixelBounds.Diagonal().y;
+		if (bandHeight > 0 && !HasExtension(filename, ".exr"))
+		{
+			Warning("Streaming films can only write EXR files; rendering \"%s\" "
+				"with the whole image in memory", filename.c_str());
+			bandHeight = 0;
+		}
+		if (bandHeight > 0 && aovMask)
+		{
+			Warning("AOVs are not supported by streaming films and are ignored");
+			aovMask = 0;
+		}
+		outputAOVMask = aovMask;
+		if (!this->denoisedFilename.empty())
+		{
+			if (bandHeight > 0)
+			{
+				Warning("Streaming films can't be denoised; not writing \"%s\"",
+					this->denoisedFilename.c_str());
+				this->denoisedFilename.clear();
+			}
+			else
+				aovMask |= AOVBit(AOV::Albedo) | AOVBit(AOV::Normal) | AOVBit(AOV::Depth);
+		}
+		this->bandHeight = bandHeight;
+		nPixelRows = height;
+		if (bandHeight > 0)
+		{
+			nPixelRows = std::min(height,
+				bandHeight + 2 * static_cast<int>(std::ceil(filter->radius.y)) + 4);
+			nextRowToWrite = croppedPixelBounds.pMin.y;
+			streamWriter.reset(new EXRScanlineWriter(filename, { "R", "G", "B" },
+				halfOutput, croppedPixelBounds, fullResolution));
+		}
+		pixels.reset(new Pixel[size_t(width) * nPixelRows]);
+
+		// Report the film's memory needs before rendering starts
+		const size_t nPixels = croppedPixelBounds.Area();
+		const size_t outputBytes = bandHeight > 0 ? 0 :
+			nPixels * 3 * (halfOutput ? sizeof(uint16_t) : sizeof(float));
+		Info("Film %dx%d: %.1f MB for %d rows of pixels, %.1f MB more if "
+		     "splatted to, %.1f MB for the %s output image",
+		     width, height, size_t(width) * nPixelRows * sizeof(Pixel) / (1024. * 1024.),
+		     nPixelRows, nPixels * sizeof(SplatPixel) / (1024. * 1024.),
+		     outputBytes / (1024. * 1024.), halfOutput ? "half" : "float");
+		if (filterSampling)
+			filterSampler.reset(new FilterSampler(filter.get()));
+		lockFreeMerge = filterSampling && PbrtOptions.writeInterval <= 0;
+		aovs.Allocate(aovMask, croppedPixelBounds.Area());
 		int offset = 0;
 		for(int y = 0; y < filterTableWidth; ++y)
 			for(int x = 0; x <filterTableWidth; ++x)
@@ -22,12 +79,27 @@ namespace pbrt
 				Point2f p;
 				p.x = (x + .5f) * filter->radius.x / filterTableWidth;
 				p.y = (y + .5f) * filter->radius.y / filterTableWidth;
-				filterTable[++offset] = filter->Evaluate(p);
+				filterTable[offset++] = filter->Evaluate(p);
 			}
+		// For f(x, y) = g(x) h(y), f(x, 0) f(0, y) / f(0, 0) recovers f(x, y)
+		float f00 = filter->Evaluate(Point2f(0, 0));
+		if (filter->IsSeparable() && f00 != 0)
+		{
+			separableFilter = true;
+			for (int i = 0; i < filterTableWidth; ++i)
+			{
+				float t = (i + .5f) / filterTableWidth;
+				filterTableX[i] = filter->Evaluate(Point2f(t * filter->radius.x, 0));
+				filterTableY[i] = filter->Evaluate(Point2f(0, t * filter->radius.y)) / f00;
+			}
+		}
 	}
 
 	Bounds2i Film::GetSampleBounds() const
 	{
+		// Filter-distributed samples never land on neighbouring pixels
+		if (filterSampler)
+			return croppedPixelBounds;
 		Bounds2f floatBounds
 		(
 			Floor(Point2f(croppedPixelBounds.pMin) + Vector2f(.5f, .5f) - filter->radius),
@@ -46,6 +118,10 @@ namespace pbrt
 
 	std::unique_ptr<FilmTile> Film::GetFilmTile(const Bounds2i& sampleBounds)
 	{
+		if (filterSampler)
+			return std::unique_ptr<FilmTile>(new FilmTile(
+				Intersect(sampleBounds, croppedPixelBounds), filter->radius,
+				filterTable, filterTableWidth, nullptr, nullptr, aovs.mask));
 		Vector2f halfPixel = Vector2f(.5f, .5f);
 		Bounds2f floatBounds = static_cast<Bounds2f>(sampleBounds);
 		Point2i p0 = static_cast<Point2i>(Ceil(floatBounds.pMin - halfPixel - filter->radius));
@@ -54,86 +130,558 @@ namespace pbrt
 		Bounds2i tilePixelBounds =
 			Intersect(Bounds2i(p0, p1), croppedPixelBounds);
 
-		return std::unique_ptr<FilmTile>(new FilmTile(tilePixelBounds, filter->radius, filterTable, filterTableWidth));
+		return std::unique_ptr<FilmTile>(new FilmTile(tilePixelBounds, filter->radius,
+			filterTable, filterTableWidth, separableFilter ? filterTableX : nullptr,
+			separableFilter ? filterTableY : nullptr, aovs.mask));
 	}
 
 	void Film::MergeFilmTile(std::unique_ptr<FilmTile> tile)
 	{
-		std::lock_guard<std::mutex> lock(mutex);
-		for(Point2i pixel:tile->GetPixelBounds())
+		ProfilePhase p(Prof::MergeFilmTile);
+		Bounds2i tileBounds = tile->GetPixelBounds();
+		for (int y = tileBounds.pMin.y; y < tileBounds.pMax.y; ++y)
 		{
-			const FilmTilePixel& tilePixel = tile->GetPixel(pixel);
-			Pixel& mergePixel = GetPixel(pixel);
-			float xyz[3];
-			tilePixel.contribSum.ToXYZ(xyz);
-			for (int i = 0; i < 3; ++i)
-				mergePixel.xyz[i] += xyz[i];
-			mergePixel.filterWeightSum += tilePixel.filterWeightSum;
+			// Without a filter border tiles are disjoint and need no locking
+			std::unique_lock<std::mutex> lock(rowMutexes[y % nRowMutexes],
+			                                  std::defer_lock);
+			if (!lockFreeMerge)
+				lock.lock();
+			for (int x = tileBounds.pMin.x; x < tileBounds.pMax.x; ++x)
+			{
+				const FilmTilePixel& tilePixel = tile->GetPixel(Point2i(x, y));
+				Pixel& mergePixel = GetPixel(Point2i(x, y));
+				for (int i = 0; i < 3; ++i)
+					mergePixel.xyz[i] += tilePixel.xyzw[i];
+				mergePixel.filterWeightSum += tilePixel.xyzw[3];
+			}
+			if (aovs.mask)
+				for (int x = tileBounds.pMin.x; x < tileBounds.pMax.x; ++x)
+					aovs.Merge(GetPixelOffset(Point2i(x, y)), tile->GetAOVs(),
+						tile->GetPixelOffset(Point2i(x, y)));
 		}
 	}
 
 	void Film::SetImage(const Spectrum* img) const
 	{
+		if (bandHeight > 0)
+		{
+			Error("SetImage() is not supported by streaming films");
+			return;
+		}
 		const int nPixels = croppedPixelBounds.Area();
 		for(int i = 0; i < nPixels; ++i)
 		{
 			Pixel& p = pixels[i];
 			img[i].ToXYZ(p.xyz);
 			p.filterWeightSum = 1;
-			p.splatXYZ[0] = p.splatXYZ[1] = p.splatXYZ[2] = 0;
+			if (splats)
+				splats[i].xyz[0] = splats[i].xyz[1] = splats[i].xyz[2] = 0;
 		}
 	}
 
 	void Film::AddSplat(const Point2f& p, const Spectrum& v)
 	{
+		if (bandHeight > 0)
+		{
+			// Splats may land on rows that have already been written
+			static std::once_flag warned;
+			std::call_once(warned, []() {
+				Warning("Splats are not supported by streaming films and are ignored");
+			});
+			return;
+		}
 		if (!InsideExclusive(static_cast<Point2i>(p), croppedPixelBounds))
 			return;
+		std::call_once(splatsAllocated, [&]() {
+			splats.reset(new SplatPixel[croppedPixelBounds.Area()]);
+			nSplatBuffers = MaxThreadIndex();
+			splatBuffers.reset(new SplatBuffer[nSplatBuffers]);
+			hasSplats = true;
+		});
 		float xyz[3];
 		v.ToXYZ(xyz);
-		Pixel& pixel = GetPixel(static_cast<Point2i>(p));
+		int offset = GetPixelOffset(static_cast<Point2i>(p));
+		if (ThreadIndex < 0 || ThreadIndex >= nSplatBuffers)
+		{
+			// Threads outside the pool update the film directly
+			for (int i = 0; i < 3; ++i)
+				splats[offset].xyz[i].Add(xyz[i]);
+			return;
+		}
+
+		// Accumulate into this thread's buffer, using linear probing
+		SplatBuffer& buffer = splatBuffers[ThreadIndex];
+		const int mask = SplatBuffer::capacity - 1;
+		int slot = (uint32_t(offset) * 2654435761u) >> (32 - SplatBuffer::logCapacity);
+		while (buffer.offsets[slot] != offset && buffer.offsets[slot] != -1)
+			slot = (slot + 1) & mask;
+		if (buffer.offsets[slot] == -1)
+		{
+			buffer.offsets[slot] = offset;
+			buffer.xyz[slot][0] = buffer.xyz[slot][1] = buffer.xyz[slot][2] = 0;
+			++buffer.nUsed;
+		}
 		for (int i = 0; i < 3; ++i)
-			pixel.splatXYZ[i].Add(xyz[i]);
+			buffer.xyz[slot][i] += xyz[i];
+		// Keep probe sequences short
+		if (buffer.nUsed > SplatBuffer::capacity / 2)
+			SpillSplatBuffer(buffer);
+	}
+
+	std::vector<PendingSplat> Film::TakeSplats()
+	{
+		std::vector<PendingSplat> pending;
+		if (!hasSplats || ThreadIndex < 0 || ThreadIndex >= nSplatBuffers)
+			return pending;
+		SplatBuffer& buffer = splatBuffers[ThreadIndex];
+		SpillSplatBuffer(buffer);
+		pending.swap(buffer.spilled);
+		return pending;
+	}
+
+	void Film::MergeSplats(const std::vector<PendingSplat>& pending)
+	{
+		for (const PendingSplat& s : pending)
+			for (int i = 0; i < 3; ++i)
+				splats[s.offset].xyz[i].Add(s.xyz[i]);
+	}
+
+	void Film::FlushAllSplats()
+	{
+		if (!hasSplats)
+			return;
+		for (int i = 0; i < nSplatBuffers; ++i)
+			FlushSplatBuffer(splatBuffers[i]);
+	}
+
+	void Film::SpillSplatBuffer(SplatBuffer& buffer)
+	{
+		if (buffer.nUsed == 0)
+			return;
+		for (int slot = 0; slot < SplatBuffer::capacity; ++slot)
+		{
+			int offset = buffer.offsets[slot];
+			if (offset == -1)
+				continue;
+			buffer.spilled.push_back({ offset, { buffer.xyz[slot][0],
+				buffer.xyz[slot][1], buffer.xyz[slot][2] } });
+			buffer.offsets[slot] = -1;
+		}
+		buffer.nUsed = 0;
+	}
+
+	void Film::FlushSplatBuffer(SplatBuffer& buffer)
+	{
+		SpillSplatBuffer(buffer);
+		MergeSplats(buffer.spilled);
+		buffer.spilled.clear();
+	}
+
+	Film::~Film()
+	{
+		if (writerThread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(writerMutex);
+				writerExit = true;
+			}
+			writerCondition.notify_all();
+			writerThread.join();
+		}
 	}
 
 	void Film::WriteImage(float splatScale)
 	{
-		std::unique_ptr<float[]> rgb(new float[3 * croppedPixelBounds.Area()]);
-		int offset = 0;
-		for(Point2i p : croppedPixelBounds)
+		if (streamWriter)
 		{
-			Pixel& pixel = GetPixel(p);
-			XYZToRGB(pixel.xyz, &rgb[3 * offset]);
-			const float filterWeightSum = pixel.filterWeightSum;
-			if (filterWeightSum != 0)
+			// Write whatever rows remain and finish the file
+			FinishRows(std::numeric_limits<int>::max());
+			streamWriter->Close();
+			return;
+		}
+		// Reduce splats that threads have not flushed yet; rendering has
+		// finished, so no thread is still adding to its buffer
+		FlushAllSplats();
+		// Don't let an earlier snapshot overwrite the final image
+		WaitForAsyncWrites();
+		WritePixels(pixels.get(), splats.get(), aovs, splatScale);
+		if (!denoisedFilename.empty())
+			WriteDenoisedImage(splatScale);
+	}
+
+	void Film::WriteDenoisedImage(float splatScale) const
+	{
+		// Integrators that don't fill in AOVs leave no guides, and the
+		// filter would then blur across every edge
+		if (std::all_of(aovs.hitCount.begin(), aovs.hitCount.end(),
+			[](int n) { return n == 0; }))
+		{
+			Warning("No AOVs were recorded to guide the denoiser; not writing \"%s\"",
+				denoisedFilename.c_str());
+			return;
+		}
+		const int width = croppedPixelBounds.Diagonal().x;
+		const int height = croppedPixelBounds.Diagonal().y;
+		const int nPixels = croppedPixelBounds.Area();
+		std::unique_ptr<float[]> rgb(new float[3 * nPixels]);
+		std::unique_ptr<float[]> albedo(new float[3 * nPixels]);
+		ParallelFor([&](int64_t y) {
+			const int offset = y * width;
+			FinalizePixels(pixels.get(), splats.get(), offset, width, splatScale,
+				&rgb[3 * offset]);
+			for (int i = offset; i < offset + width; ++i)
 			{
-				float invWt = static_cast<float>(1) / filterWeightSum;
-				rgb[3 * offset] = std::max(static_cast<float>(0), rgb[3 * offset] * invWt);
-				rgb[3 * offset + 1] = std::max(static_cast<float>(0), rgb[3 * offset + 1] * invWt);
-				rgb[3 * offset + 2] = std::max(static_cast<float>(0), rgb[3 * offset + 2] * invWt);
+				float invHits = aovs.hitCount[i] ? 1.f / aovs.hitCount[i] : 0.f;
+				for (int c = 0; c < 3; ++c)
+					albedo[3 * i + c] = aovs.albedo[3 * i + c] * invHits;
 			}
-			float splatRGB[3];
-			float splatXYZ[3] = { pixel.splatXYZ[0], pixel.splatXYZ[1],
-								  pixel.splatXYZ[2] };
-			XYZToRGB(splatXYZ, splatRGB);
-			rgb[3 * offset] += splatScale * splatRGB[0];
-			rgb[3 * offset + 1] += splatScale * splatRGB[1];
-			rgb[3 * offset + 2] += splatScale * splatRGB[2];
+		}, height, 8);
 
-			rgb[3 * offset] *= scale;
-			rgb[3 * offset + 1] *= scale;
-			rgb[3 * offset + 2] *= scale;
-			++offset;
+		// Normals only guide by direction, so their sums need no averaging
+		DenoiseGuides guides;
+		guides.albedo = albedo.get();
+		guides.normal = aovs.normal.data();
+		guides.depth = aovs.depth.data();
+		DenoiseImage(rgb.get(), width, height, guides, DenoiseOptions(), rgb.get());
+
+		if (halfOutput)
+		{
+			std::unique_ptr<uint16_t[]> rgbHalf(new uint16_t[3 * nPixels]);
+			for (int i = 0; i < 3 * nPixels; ++i)
+				rgbHalf[i] = FloatToHalf(rgb[i]);
+			pbrt::WriteImage(denoisedFilename, &rgbHalf[0], croppedPixelBounds, fullResolution);
+		}
+		else
+			pbrt::WriteImage(denoisedFilename, &rgb[0], croppedPixelBounds, fullResolution);
+	}
+
+	void Film::SaveCheckpoint(std::vector<char>* data) const
+	{
+		const int nPixels = croppedPixelBounds.Area();
+		AppendBytes(data, &croppedPixelBounds.pMin, 1);
+		AppendBytes(data, &croppedPixelBounds.pMax, 1);
+		AppendBytes(data, &aovs.mask, 1);
+		AppendBytes(data, pixels.get(), nPixels);
+		uint8_t splatFlag = hasSplats ? 1 : 0;
+		AppendBytes(data, &splatFlag, 1);
+		if (splatFlag)
+			for (int i = 0; i < nPixels; ++i)
+			{
+				float xyz[3] = { float(splats[i].xyz[0]), float(splats[i].xyz[1]),
+					float(splats[i].xyz[2]) };
+				AppendBytes(data, xyz, 3);
+			}
+		auto save = [&](const auto& v) { AppendBytes(data, v.data(), v.size()); };
+		save(aovs.depth);
+		save(aovs.primitiveId);
+		save(aovs.normal);
+		save(aovs.albedo);
+		save(aovs.hitCount);
+		save(aovs.sampleCount);
+	}
+
+	bool Film::LoadCheckpoint(const char** p, const char* end)
+	{
+		if (bandHeight > 0)
+			return false;
+		const int nPixels = croppedPixelBounds.Area();
+		Bounds2i bounds;
+		uint32_t mask;
+		if (!ReadBytes(p, end, &bounds.pMin, 1) || !ReadBytes(p, end, &bounds.pMax, 1) ||
+			bounds != croppedPixelBounds ||
+			!ReadBytes(p, end, &mask, 1) || mask != aovs.mask)
+			return false;
+		std::unique_ptr<Pixel[]> newPixels(new Pixel[nPixels]);
+		uint8_t splatFlag;
+		if (!ReadBytes(p, end, newPixels.get(), nPixels) ||
+			!ReadBytes(p, end, &splatFlag, 1))
+			return false;
+		std::vector<float> splatXYZ;
+		if (splatFlag)
+		{
+			splatXYZ.resize(3 * size_t(nPixels));
+			if (!ReadBytes(p, end, splatXYZ.data(), splatXYZ.size()))
+				return false;
+		}
+		AOVBuffers newAOVs;
+		newAOVs.Allocate(aovs.mask, nPixels);
+		auto load = [&](auto& v) { return ReadBytes(p, end, v.data(), v.size()); };
+		if (!load(newAOVs.depth) || !load(newAOVs.primitiveId) ||
+			!load(newAOVs.normal) || !load(newAOVs.albedo) ||
+			!load(newAOVs.hitCount) || !load(newAOVs.sampleCount))
+			return false;
+
+		pixels = std::move(newPixels);
+		aovs = std::move(newAOVs);
+		if (splatFlag)
+		{
+			std::call_once(splatsAllocated, [&]() {
+				splats.reset(new SplatPixel[nPixels]);
+				nSplatBuffers = MaxThreadIndex();
+				splatBuffers.reset(new SplatBuffer[nSplatBuffers]);
+				hasSplats = true;
+			});
+			for (int i = 0; i < nPixels; ++i)
+				for (int c = 0; c < 3; ++c)
+					splats[i].xyz[c] = splatXYZ[3 * i + c];
+		}
+		return true;
+	}
+
+	void Film::WriteImageAsync(float splatScale)
+	{
+		// Streaming films write their rows as they complete
+		if (bandHeight > 0)
+			return;
+		// Like pixels, splats still in threads' buffers belong to tiles that
+		// have not been merged yet, and are left for a later snapshot
+		// Copy the film a row at a time under the merge locks
+		const int width = croppedPixelBounds.Diagonal().x;
+		const int height = croppedPixelBounds.Diagonal().y;
+		std::unique_ptr<Snapshot> snapshot(new Snapshot);
+		snapshot->pixels.reset(new Pixel[croppedPixelBounds.Area()]);
+		if (hasSplats)
+			snapshot->splats.reset(new SplatPixel[croppedPixelBounds.Area()]);
+		snapshot->aovs.Allocate(aovs.mask, croppedPixelBounds.Area());
+		snapshot->splatScale = splatScale;
+		for (int y = 0; y < height; ++y)
+		{
+			const int offset = y * width;
+			{
+				std::lock_guard<std::mutex> lock(rowMutexes[(croppedPixelBounds.pMin.y + y) % nRowMutexes]);
+				memcpy(&snapshot->pixels[offset], &pixels[offset], width * sizeof(Pixel));
+				snapshot->aovs.CopyRange(aovs, offset, width);
+			}
+			if (snapshot->splats)
+				for (int x = offset; x < offset + width; ++x)
+					for (int i = 0; i < 3; ++i)
+						snapshot->splats[x].xyz[i] = float(splats[x].xyz[i]);
+		}
+
+		std::lock_guard<std::mutex> lock(writerMutex);
+		if (!writerThread.joinable())
+			writerThread = std::thread(&Film::WriterThreadFunc, this);
+		pendingSnapshot = std::move(snapshot);
+		writerCondition.notify_all();
+	}
+
+	void Film::FinishRows(int sampleRowEnd)
+	{
+		if (!streamWriter)
+			return;
+		// Samples at or below _sampleRowEnd_ can't reach rows above _rowEnd_
+		int rowEnd = croppedPixelBounds.pMax.y;
+		if (sampleRowEnd < GetSampleBounds().pMax.y)
+			rowEnd = std::min(rowEnd, filterSampler ? sampleRowEnd :
+				static_cast<int>(std::ceil(sampleRowEnd - 0.5f - filter->radius.y)));
+		if (rowEnd <= nextRowToWrite)
+			return;
+
+		const int width = croppedPixelBounds.Diagonal().x;
+		const int nRows = rowEnd - nextRowToWrite;
+		std::vector<float> rgb(3 * size_t(width) * nRows);
+		ParallelFor([&](int64_t i) {
+			int y = nextRowToWrite + static_cast<int>(i);
+			int offset = GetPixelOffset(Point2i(croppedPixelBounds.pMin.x, y));
+			FinalizePixels(pixels.get(), nullptr, offset, width, 1,
+				&rgb[3 * size_t(width) * i]);
+			// Clear the row for reuse by a later band
+			std::fill(&pixels[offset], &pixels[offset] + width, Pixel());
+		}, nRows, 8);
+		streamWriter->AddRows(&rgb[0], nRows);
+		nextRowToWrite = rowEnd;
+	}
+
+	void Film::WriterThreadFunc()
+	{
+		std::unique_lock<std::mutex> lock(writerMutex);
+		while (true)
+		{
+			writerCondition.wait(lock, [this] { return pendingSnapshot || writerExit; });
+			if (!pendingSnapshot)
+				return;
+			std::unique_ptr<Snapshot> snapshot = std::move(pendingSnapshot);
+			writerBusy = true;
+			lock.unlock();
+			WritePixels(snapshot->pixels.get(), snapshot->splats.get(),
+				snapshot->aovs, snapshot->splatScale);
+			lock.lock();
+			writerBusy = false;
+			writerCondition.notify_all();
+		}
+	}
+
+	void Film::WaitForAsyncWrites()
+	{
+		std::unique_lock<std::mutex> lock(writerMutex);
+		// A pending snapshot is stale once the final image is being written
+		pendingSnapshot.reset();
+		writerCondition.wait(lock, [this] { return !writerBusy; });
+	}
+
+	void Film::WritePixels(const Pixel* pixelData, const SplatPixel* splatData,
+		const AOVBuffers& aovData, float splatScale) const
+	{
+		// Finalized pixels go to either a float or a half-float image
+		const int width = croppedPixelBounds.Diagonal().x;
+		const int height = croppedPixelBounds.Diagonal().y;
+		const int nPixels = croppedPixelBounds.Area();
+		std::unique_ptr<float[]> rgb;
+		std::unique_ptr<uint16_t[]> rgbHalf;
+		if (halfOutput)
+			rgbHalf.reset(new uint16_t[3 * nPixels]);
+		else
+			rgb.reset(new float[3 * nPixels]);
+		ParallelFor([&](int64_t y) {
+			const int offset = y * width;
+			if (!halfOutput)
+			{
+				FinalizePixels(pixelData, splatData, offset, width, splatScale, &rgb[3 * offset]);
+				return;
+			}
+			float* rowRGB = ALLOCA(float, 3 * width);
+			FinalizePixels(pixelData, splatData, offset, width, splatScale, rowRGB);
+			for (int i = 0; i < 3 * width; ++i)
+				rgbHalf[3 * offset + i] = FloatToHalf(rowRGB[i]);
+		}, height, 8);
+
+		const uint32_t aovMask = aovData.mask & outputAOVMask;
+		if (aovMask && HasExtension(filename, ".exr"))
+		{
+			// AOVs go into the same file as extra channels
+			std::vector<ImageChannel> channels;
+			const char* rgbNames[3] = { "R", "G", "B" };
+			for (int c = 0; c < 3; ++c)
+			{
+				ImageChannel channel;
+				channel.name = rgbNames[c];
+				channel.data = halfOutput ? nullptr : &rgb[c];
+				channel.halfData = halfOutput ? &rgbHalf[c] : nullptr;
+				channel.stride = 3;
+				channels.push_back(channel);
+			}
+			std::vector<std::vector<float>> aovImages;
+			aovImages.reserve(5);
+			auto addChannels = [&](std::vector<float> image, int nc,
+				std::initializer_list<const char*> names) {
+				aovImages.push_back(std::move(image));
+				int c = 0;
+				for (const char* name : names)
+				{
+					ImageChannel channel;
+					channel.name = name;
+					channel.data = &aovImages.back()[c++];
+					channel.stride = nc;
+					channels.push_back(channel);
+				}
+			};
+			// Normals and albedo are averaged over the samples that hit
+			auto averageOverHits = [&](const std::vector<float>& sums) {
+				std::vector<float> avg(sums.size());
+				for (int i = 0; i < nPixels; ++i)
+				{
+					float invHits = aovData.hitCount[i] ? 1.f / aovData.hitCount[i] : 0.f;
+					for (int c = 0; c < 3; ++c)
+						avg[3 * i + c] = sums[3 * i + c] * invHits;
+				}
+				return avg;
+			};
+			if (aovMask & AOVBit(AOV::Depth))
+				addChannels(aovData.depth, 1, { "Z" });
+			if (aovMask & AOVBit(AOV::Normal))
+				addChannels(averageOverHits(aovData.normal), 3, { "N.X", "N.Y", "N.Z" });
+			if (aovMask & AOVBit(AOV::Albedo))
+				addChannels(averageOverHits(aovData.albedo), 3,
+					{ "albedo.R", "albedo.G", "albedo.B" });
+			if (aovMask & AOVBit(AOV::PrimitiveID))
+				addChannels(aovData.primitiveId, 1, { "primitiveId" });
+			if (aovMask & AOVBit(AOV::SampleCount))
+				addChannels(std::vector<float>(aovData.sampleCount.begin(),
+					aovData.sampleCount.end()), 1, { "sampleCount" });
+			WriteEXR(filename, std::move(channels), croppedPixelBounds, fullResolution);
+			return;
+		}
+		if (aovMask)
+			Warning("AOVs can only be written to EXR files; \"%s\" will "
+				"only hold the image", filename.c_str());
+		if (halfOutput)
+			pbrt::WriteImage(filename, &rgbHalf[0], croppedPixelBounds, fullResolution);
+		else
+			pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
+	}
+
+	void Film::FinalizePixels(const Pixel* pixelData, const SplatPixel* splatData,
+		int offset, int n, float splatScale, float* rgb) const
+	{
+		// Transpose blocks of pixels to SoA so that the loops vectorize
+		constexpr int blockSize = 8;
+		for (int start = 0; start < n; start += blockSize)
+		{
+			const int count = std::min(blockSize, n - start);
+			float x[blockSize] = {}, y[blockSize] = {}, z[blockSize] = {};
+			float invWt[blockSize];
+			for (int i = 0; i < count; ++i)
+			{
+				const Pixel& p = pixelData[offset + start + i];
+				x[i] = p.xyz[0];
+				y[i] = p.xyz[1];
+				z[i] = p.xyz[2];
+				invWt[i] = p.filterWeightSum != 0 ? 1 / p.filterWeightSum : 1;
+			}
+			for (int i = count; i < blockSize; ++i)
+				invWt[i] = 1;
+
+			// Normalized, clamped RGB of the filtered samples
+			float r[blockSize], g[blockSize], b[blockSize];
+			for (int i = 0; i < blockSize; ++i)
+			{
+				const float xyz[3] = { x[i], y[i], z[i] };
+				float c[3];
+				XYZToRGB(xyz, c);
+				r[i] = std::max(0.f, c[0] * invWt[i]);
+				g[i] = std::max(0.f, c[1] * invWt[i]);
+				b[i] = std::max(0.f, c[2] * invWt[i]);
+			}
+
+			if (splatData)
+			{
+				for (int i = 0; i < count; ++i)
+				{
+					const SplatPixel& s = splatData[offset + start + i];
+					x[i] = s.xyz[0];
+					y[i] = s.xyz[1];
+					z[i] = s.xyz[2];
+				}
+				for (int i = 0; i < blockSize; ++i)
+				{
+					const float xyz[3] = { x[i], y[i], z[i] };
+					float c[3];
+					XYZToRGB(xyz, c);
+					r[i] += splatScale * c[0];
+					g[i] += splatScale * c[1];
+					b[i] += splatScale * c[2];
+				}
+			}
+
+			for (int i = 0; i < count; ++i)
+			{
+				rgb[3 * (start + i)] = r[i] * scale;
+				rgb[3 * (start + i) + 1] = g[i] * scale;
+				rgb[3 * (start + i) + 2] = b[i] * scale;
+			}
 		}
-		pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
 	}
 
 	FilmTile::FilmTile(const Bounds2i& pixelBounds, const Vector2f& filterRadius, const float* filterTable,
-	                   int filterTableSize)
+	                   int filterTableSize, const float* filterTableX, const float* filterTableY,
+	                   uint32_t aovMask)
 		: pixelBounds(pixelBounds), filterRadius(filterRadius),
 		  invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
 		  filterTable(filterTable), filterTableSize(filterTableSize),
+		  filterTableX(filterTableX), filterTableY(filterTableY),
 		  pixels(std::max(0, pixelBounds.Area()))
 	{
+		aovs.Allocate(aovMask, std::max(0, pixelBounds.Area()));
 	}
 
 	void FilmTile::AddSample(const Point2f& pFilm, Spectrum L, float sampleWeight)
@@ -145,6 +693,14 @@ namespace pbrt
 			(Point2i)Floor(pFilmDiscrete + filterRadius) + Point2i(1, 1);
 		p0 = Max(p0, pixelBounds.pMin);
 		p1 = Min(p1, pixelBounds.pMax);
+		if (p0.x >= p1.x || p0.y >= p1.y) return;
+
+		// Convert the sample to XYZ once rather than splatting every
+		// spectral channel into each pixel of the footprint
+		alignas(16) float v[4];
+		L.ToXYZ(v);
+		for (int i = 0; i < 3; ++i) v[i] *= sampleWeight;
+		v[3] = 1;
 
 		// Loop over filter support and add sample to pixel arrays
 
@@ -161,25 +717,139 @@ namespace pbrt
 				filterTableSize);
 			ify[y - p0.y] = std::min((int)std::floor(fy), filterTableSize - 1);
 		}
+		// Separable filters only need the two 1D weights per pixel
+		float* wx = nullptr;
+		if (filterTableX)
+		{
+			wx = ALLOCA(float, p1.x - p0.x);
+			for (int x = p0.x; x < p1.x; ++x)
+				wx[x - p0.x] = filterTableX[ifx[x - p0.x]];
+		}
 		for (int y = p0.y; y < p1.y; ++y) {
+			FilmTilePixel* row = &GetPixel(Point2i(p0.x, y));
+			float wy = filterTableY ? filterTableY[ify[y - p0.y]] : 0;
 			for (int x = p0.x; x < p1.x; ++x) {
 				// Evaluate filter value at $(x,y)$ pixel
-				int offset = ify[y - p0.y] * filterTableSize + ifx[x - p0.x];
-				float filterWeight = filterTable[offset];
+				float filterWeight = wx ? wx[x - p0.x] * wy :
+					filterTable[ify[y - p0.y] * filterTableSize + ifx[x - p0.x]];
 
 				// Update pixel values with filtered sample contribution
-				FilmTilePixel& pixel = GetPixel(Point2i(x, y));
-				pixel.contribSum += L * sampleWeight * filterWeight;
-				pixel.filterWeightSum += filterWeight;
+				float* sum = row[x - p0.x].xyzw;
+				for (int i = 0; i < 4; ++i)
+					sum[i] += v[i] * filterWeight;
 			}
 		}
 	}
 
+	void FilmTile::AddPixelSample(const Point2i& pPixel, const Spectrum& L,
+	                              float filterWeight, float sampleWeight)
+	{
+		if (!InsideExclusive(pPixel, pixelBounds))
+			return;
+		float xyz[3];
+		L.ToXYZ(xyz);
+		// As in AddSample(), the ray weight scales the sample but not the
+		// pixel's weight sum
+		float* sum = GetPixel(pPixel).xyzw;
+		for (int i = 0; i < 3; ++i)
+			sum[i] += filterWeight * sampleWeight * xyz[i];
+		sum[3] += filterWeight;
+	}
+
 	FilmTilePixel& FilmTile::GetPixel(const Point2i& p)
+	{
+		return pixels[GetPixelOffset(p)];
+	}
+
+	int FilmTile::GetPixelOffset(const Point2i& p) const
 	{
 		int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-		int offset = (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-		return pixels[offset];
+		return (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
+	}
+
+	void FilmTile::AddAOVSample(const Point2i& pPixel, const AOVSample& sample)
+	{
+		if (InsideExclusive(pPixel, pixelBounds))
+			aovs.AddSample(GetPixelOffset(pPixel), sample);
+	}
+
+	void AOVBuffers::Allocate(uint32_t aovMask, int nPixels)
+	{
+		mask = aovMask;
+		if (mask & (AOVBit(AOV::Depth) | AOVBit(AOV::PrimitiveID)))
+			depth.assign(nPixels, Infinity);
+		if (mask & AOVBit(AOV::PrimitiveID))
+			primitiveId.assign(nPixels, -1.f);
+		if (mask & AOVBit(AOV::Normal))
+			normal.assign(3 * nPixels, 0.f);
+		if (mask & AOVBit(AOV::Albedo))
+			albedo.assign(3 * nPixels, 0.f);
+		if (mask & (AOVBit(AOV::Normal) | AOVBit(AOV::Albedo)))
+			hitCount.assign(nPixels, 0);
+		if (mask & AOVBit(AOV::SampleCount))
+			sampleCount.assign(nPixels, 0);
+	}
+
+	void AOVBuffers::AddSample(int offset, const AOVSample& sample)
+	{
+		if (!sampleCount.empty())
+			++sampleCount[offset];
+		if (!sample.hit)
+			return;
+		if (!depth.empty() && sample.depth < depth[offset])
+		{
+			depth[offset] = sample.depth;
+			if (!primitiveId.empty())
+				primitiveId[offset] = static_cast<float>(sample.primitiveId);
+		}
+		if (!hitCount.empty())
+			++hitCount[offset];
+		if (!normal.empty())
+			for (int c = 0; c < 3; ++c)
+				normal[3 * offset + c] += sample.n[c];
+		if (!albedo.empty())
+		{
+			float rgb[3];
+			sample.albedo.ToRGB(rgb);
+			for (int c = 0; c < 3; ++c)
+				albedo[3 * offset + c] += rgb[c];
+		}
+	}
+
+	void AOVBuffers::Merge(int offset, const AOVBuffers& src, int srcOffset)
+	{
+		if (!sampleCount.empty())
+			sampleCount[offset] += src.sampleCount[srcOffset];
+		if (!depth.empty() && src.depth[srcOffset] < depth[offset])
+		{
+			depth[offset] = src.depth[srcOffset];
+			if (!primitiveId.empty())
+				primitiveId[offset] = src.primitiveId[srcOffset];
+		}
+		if (!hitCount.empty())
+			hitCount[offset] += src.hitCount[srcOffset];
+		for (int c = 0; c < 3; ++c)
+		{
+			if (!normal.empty())
+				normal[3 * offset + c] += src.normal[3 * srcOffset + c];
+			if (!albedo.empty())
+				albedo[3 * offset + c] += src.albedo[3 * srcOffset + c];
+		}
+	}
+
+	void AOVBuffers::CopyRange(const AOVBuffers& src, int offset, int n)
+	{
+		auto copy = [&](auto& dst, const auto& from, int nc) {
+			if (!dst.empty())
+				std::copy(from.begin() + nc * offset, from.begin() + nc * (offset + n),
+					dst.begin() + nc * offset);
+		};
+		copy(depth, src.depth, 1);
+		copy(primitiveId, src.primitiveId, 1);
+		copy(normal, src.normal, 3);
+		copy(albedo, src.albedo, 3);
+		copy(hitCount, src.hitCount, 1);
+		copy(sampleCount, src.sampleCount, 1);
 	}
 
 	Film* CreateFilm(const ParamSet& params, std::unique_ptr<Filter> filter)
@@ -222,7 +892,40 @@ namespace pbrt
 		float diagonal = params.FindOneFloat("diagonal", 35.);
 		float maxSampleLuminance = params.FindOneFloat("maxsampleluminance",
 			pbrt::Infinity);
+		bool filterSampling = params.FindOneBool("filtersampling", false);
+		bool halfOutput = params.FindOneBool("halfoutput", false);
+		uint32_t aovMask = 0;
+		int nAOVs = 0;
+		const std::string* aovNames = params.FindString("aovs", &nAOVs);
+		for (int i = 0; i < nAOVs; ++i)
+		{
+			if (aovNames[i] == "depth")
+				aovMask |= AOVBit(AOV::Depth);
+			else if (aovNames[i] == "normal")
+				aovMask |= AOVBit(AOV::Normal);
+			else if (aovNames[i] == "albedo")
+				aovMask |= AOVBit(AOV::Albedo);
+			else if (aovNames[i] == "primitiveid")
+				aovMask |= AOVBit(AOV::PrimitiveID);
+			else if (aovNames[i] == "samplecount")
+				aovMask |= AOVBit(AOV::SampleCount);
+			else
+				Warning("Unknown AOV \"%s\" ignored.", aovNames[i].c_str());
+		}
+		int bandHeight = params.FindOneInt("bandheight", 0);
+		// The denoised image goes next to the image, as "name_denoised.ext"
+		// unless named otherwise
+		std::string denoisedFilename;
+		if (params.FindOneBool("denoise", false))
+		{
+			size_t dot = filename.find_last_of('.');
+			if (dot == std::string::npos || filename.find_first_of("/\\", dot) != std::string::npos)
+				dot = filename.size();
+			denoisedFilename = params.FindOneString("denoisedfilename",
+				filename.substr(0, dot) + "_denoised" + filename.substr(dot));
+		}
 		return new Film(Point2i(xres, yres), crop, std::move(filter), diagonal,
-			filename, scale, maxSampleLuminance);
+			filename, scale, maxSampleLuminance, filterSampling, halfOutput, aovMask,
+			bandHeight, denoisedFilename);
 	}
 }
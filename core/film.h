@@ -6,68 +6,228 @@
 #include "filter.h"
 #include "parallel.h"
 #include "spectrum.h"
+#include "imageio.h"
+#include <thread>
 
 namespace pbrt
 {
+	// Extra per-pixel outputs, requested with the film's "aovs" parameter
+	enum class AOV { Depth, Normal, Albedo, PrimitiveID, SampleCount };
+	inline uint32_t AOVBit(AOV aov) { return 1u << static_cast<int>(aov); }
+
+	// First-hit values for one camera sample, filled in by Li()
+	struct AOVSample
+	{
+		uint32_t requested = 0;
+		bool hit = false;
+		float depth = Infinity;
+		Normal3f n;
+		Spectrum albedo = Spectrum(0.f);
+		int primitiveId = -1;
+	};
+
+	// Per-pixel AOV sums. Only the buffers needed by the requested AOVs are
+	// allocated; depth is kept for primitive IDs too, which come from the
+	// nearest hit in the pixel.
+	struct AOVBuffers
+	{
+		void Allocate(uint32_t aovMask, int nPixels);
+		void AddSample(int offset, const AOVSample& sample);
+		void Merge(int offset, const AOVBuffers& src, int srcOffset);
+		void CopyRange(const AOVBuffers& src, int offset, int n);
+		uint32_t mask = 0;
+		std::vector<float> depth, normal, albedo, primitiveId;
+		std::vector<int> hitCount, sampleCount;
+	};
+
+	// A splat waiting in a thread's buffer, keyed by pixel offset
+	struct PendingSplat
+	{
+		int offset;
+		float xyz[3];
+	};
+
 	class Film
 	{
 	public:
 		Film(const Point2i& resolution, const Bounds2f& cropWindow,
 			std::unique_ptr<Filter> filt, float diagonal,
-			const std::string& filename, float scale, float maxSampleLuminance);
+			const std::string& filename, float scale, float maxSampleLuminance,
+			bool filterSampling = false, bool halfOutput = false,
+			uint32_t aovMask = 0, int bandHeight = 0,
+			const std::string& denoisedFilename = "");
+		~Film();
 		Bounds2i GetSampleBounds() const;
 		Bounds2f GetPhysicalExtent() const;
 		std::unique_ptr<FilmTile> GetFilmTile(const Bounds2i& sampleBounds);
 		void MergeFilmTile(std::unique_ptr<FilmTile> tile);
 		void SetImage(const Spectrum* img) const;
 		void AddSplat(const Point2f& p, const Spectrum& v);
+		// Removes and returns the calling thread's pending splats, so that
+		// they can be merged along with the tile that made them
+		std::vector<PendingSplat> TakeSplats();
+		void MergeSplats(const std::vector<PendingSplat>& pending);
+		// Reduces the calling thread's pending splats into the film; called
+		// at pass boundaries by threads that splat outside of tiles
+		void FlushSplats() { MergeSplats(TakeSplats()); }
+		// Also writes a denoised copy of the image if the film was given a
+		// filename for it
 		void WriteImage(float splatScale = 1);
+		// Copies the film's current state and returns; a background thread
+		// finalizes and writes the copy while rendering continues. A copy
+		// still waiting to be written is replaced by the newer one.
+		void WriteImageAsync(float splatScale = 1);
+		// Non-null when camera samples are distributed according to the
+		// filter and each one contributes only to its own pixel
+		const FilterSampler* GetFilterSampler() const { return filterSampler.get(); }
+		uint32_t GetAOVMask() const { return aovs.mask; }
+		// Rows of samples to render at a time for streaming films, which
+		// only hold the rows those samples reach; 0 if not streaming
+		int GetBandHeight() const { return bandHeight; }
+		// Called once all samples above _sampleRowEnd_ have been merged;
+		// streaming films finalize and write the rows that are complete
+		void FinishRows(int sampleRowEnd);
+		// Appends the film's accumulated state to _data_, or restores it;
+		// LoadCheckpoint() returns false if the data doesn't match this
+		// film. No tiles may be merged while either runs.
+		void SaveCheckpoint(std::vector<char>* data) const;
+		bool LoadCheckpoint(const char** p, const char* end);
 		const Point2i fullResolution;
 		const float diagonal;
 		std::unique_ptr<Filter> filter;
 		const std::string filename;
 		Bounds2i croppedPixelBounds;
 	private:
-		std::mutex mutex;
+		// Tiles overlap by the filter radius, so merges lock only the rows
+		// they are adding to; row y uses rowMutexes[y % nRowMutexes]
+		static constexpr int nRowMutexes = 64;
+		std::mutex rowMutexes[nRowMutexes];
+		// Disjoint tiles merge without locks unless snapshots are taken
+		// while rendering
+		bool lockFreeMerge = false;
 		const float scale;
+		const bool halfOutput;
+		// Empty unless a denoised copy of the image is written
+		std::string denoisedFilename;
+		std::unique_ptr<FilterSampler> filterSampler;
 		struct Pixel
 		{
 			float xyz[3] = { 0, 0, 0 };
 			float filterWeightSum = 0;
-			AtomicFloat splatXYZ[3];
-			float pad;
 		};
 		std::unique_ptr<Pixel[]> pixels;
+		AOVBuffers aovs;
+		// AOVs written as channels of the image; the denoiser's guides are
+		// gathered whether or not they were asked for
+		uint32_t outputAOVMask = 0;
+		// Streaming state; _pixels_ holds _nPixelRows_ rows, used as a ring
+		int bandHeight = 0, nPixelRows = 0, nextRowToWrite = 0;
+		std::unique_ptr<EXRScanlineWriter> streamWriter;
+		// Splats are kept apart from _pixels_ and only allocated by the
+		// first AddSplat() call, since most integrators never splat
+		struct SplatPixel
+		{
+			AtomicFloat xyz[3];
+		};
+		// Set once _splats_ and _splatBuffers_ are allocated; other threads
+		// must check it before touching either
+		std::once_flag splatsAllocated;
+		std::atomic<bool> hasSplats{ false };
+		std::unique_ptr<SplatPixel[]> splats;
+		// Per-thread open-addressed tables of pending splats, keyed by pixel
+		// offset, so that repeated splats to a pixel cost one atomic update.
+		// A table more than half full moves its entries to _spilled_ rather
+		// than to the film, so that they stay with the thread's tile.
+		// Only the owning thread touches its buffer while rendering, so
+		// splats take no locks or atomics.
+		struct alignas(64) SplatBuffer
+		{
+			static constexpr int logCapacity = 12;
+			static constexpr int capacity = 1 << logCapacity;
+			SplatBuffer() { std::fill(offsets, offsets + capacity, -1); }
+			int nUsed = 0;
+			int offsets[capacity];
+			float xyz[capacity][3];
+			std::vector<PendingSplat> spilled;
+		};
+		int nSplatBuffers = 0;
+		std::unique_ptr<SplatBuffer[]> splatBuffers;
+		// Moves the table's entries to _spilled_
+		void SpillSplatBuffer(SplatBuffer& buffer);
+		void FlushSplatBuffer(SplatBuffer& buffer);
+		// Reduces every thread's pending splats into the final image; no
+		// thread may be splatting
+		void FlushAllSplats();
+		// Writes scaled RGB for the _n_ pixels starting at _offset_
+		void FinalizePixels(const Pixel* pixelData, const SplatPixel* splatData,
+			int offset, int n, float splatScale, float* rgb) const;
+		void WritePixels(const Pixel* pixelData, const SplatPixel* splatData,
+			const AOVBuffers& aovData, float splatScale) const;
+		void WriteDenoisedImage(float splatScale) const;
+		// Background writer state for WriteImageAsync()
+		struct Snapshot
+		{
+			std::unique_ptr<Pixel[]> pixels;
+			std::unique_ptr<SplatPixel[]> splats;
+			AOVBuffers aovs;
+			float splatScale;
+		};
+		std::thread writerThread;
+		std::mutex writerMutex;
+		std::condition_variable writerCondition;
+		std::unique_ptr<Snapshot> pendingSnapshot;
+		bool writerBusy = false, writerExit = false;
+		void WriterThreadFunc();
+		void WaitForAsyncWrites();
 		static constexpr int filterTableWidth = 16;
 		float filterTable[filterTableWidth * filterTableWidth];
-		Pixel& GetPixel(const Point2i& p)
+		// 1D tables whose product gives _filterTable_ for separable filters
+		bool separableFilter = false;
+		float filterTableX[filterTableWidth], filterTableY[filterTableWidth];
+		int GetPixelOffset(const Point2i& p) const
 		{
 			int width = croppedPixelBounds.pMax.x - croppedPixelBounds.pMin.x;
-			int offset = (p.x - croppedPixelBounds.pMin.x) + (p.y - croppedPixelBounds.pMin.y) * width;
-			return pixels[offset];
+			int row = p.y - croppedPixelBounds.pMin.y;
+			if (bandHeight > 0)
+				row %= nPixelRows;
+			return (p.x - croppedPixelBounds.pMin.x) + row * width;
+		}
+		Pixel& GetPixel(const Point2i& p)
+		{
+			return pixels[GetPixelOffset(p)];
 		}
 	};
 
-	struct FilmTilePixel {
-		Spectrum contribSum = 0.f;
-		float filterWeightSum = 0.f;
+	// Filtered XYZ sum in xyzw[0..2] and filter weight sum in xyzw[3], laid
+	// out so that a sample is added to a pixel with one 4-wide multiply-add
+	struct alignas(16) FilmTilePixel {
+		float xyzw[4] = { 0, 0, 0, 0 };
 	};
 
 	class FilmTile
 	{
 	public:
 		FilmTile(const Bounds2i& pixelBounds, const Vector2f& filterRadius,
-			const float* filterTable, int filterTableSize);
+			const float* filterTable, int filterTableSize,
+			const float* filterTableX = nullptr, const float* filterTableY = nullptr,
+			uint32_t aovMask = 0);
 		void AddSample(const Point2f& pFilm, Spectrum L,
 			float sampleWeight = 1.);
+		void AddPixelSample(const Point2i& pPixel, const Spectrum& L,
+			float filterWeight, float sampleWeight = 1.);
+		void AddAOVSample(const Point2i& pPixel, const AOVSample& sample);
 		FilmTilePixel& GetPixel(const Point2i& p);
+		int GetPixelOffset(const Point2i& p) const;
+		const AOVBuffers& GetAOVs() const { return aovs; }
 		Bounds2i GetPixelBounds() const { return pixelBounds; }
 	private:
 		const Bounds2i pixelBounds;
 		const Vector2f filterRadius, invFilterRadius;
 		const float* filterTable;
 		const int filterTableSize;
+		const float *filterTableX, *filterTableY;
 		std::vector<FilmTilePixel> pixels;
+		AOVBuffers aovs;
 	};
 
 	Film* CreateFilm(const ParamSet& paramSet, std::unique_ptr<Filter> filter);
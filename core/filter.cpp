@@ -6,4 +6,39 @@ namespace pbrt
 		: radius(radius), invRadius(Vector2f(1 / radius.x, 1 / radius.y))
 	{
 	}
+
+	FilterSampler::FilterSampler(const Filter* filter, int samplesPerRadius)
+		: domain(Point2f(-filter->radius.x, -filter->radius.y),
+		                         Point2f(filter->radius.x, filter->radius.y)),
+		  nx(std::max(1, int(2 * samplesPerRadius * filter->radius.x))),
+		  ny(std::max(1, int(2 * samplesPerRadius * filter->radius.y))),
+		  f(nx * ny)
+	{
+		// Tabulate the filter at cell centers over its support
+		Vector2f cellSize(2 * filter->radius.x / nx, 2 * filter->radius.y / ny);
+		std::vector<float> absF(nx * ny);
+		float absSum = 0;
+		for (int y = 0; y < ny; ++y)
+			for (int x = 0; x < nx; ++x)
+			{
+				Point2f p(domain.pMin.x + (x + .5f) * cellSize.x,
+				          domain.pMin.y + (y + .5f) * cellSize.y);
+				f[y * nx + x] = filter->Evaluate(p);
+				absF[y * nx + x] = std::abs(f[y * nx + x]);
+				absSum += absF[y * nx + x];
+			}
+		absIntegral = absSum * cellSize.x * cellSize.y;
+		distrib.reset(new Distribution2D(&absF[0], nx, ny));
+	}
+
+	FilterSample FilterSampler::Sample(const Point2f& u) const
+	{
+		float pdf;
+		Point2f uv = distrib->SampleContinuous(u, &pdf);
+		Point2f p(Lerp(uv.x, domain.pMin.x, domain.pMax.x),
+		          Lerp(uv.y, domain.pMin.y, domain.pMax.y));
+		int x = std::min(int(uv.x * nx), nx - 1);
+		int y = std::min(int(uv.y * ny), ny - 1);
+		return { p, f[y * nx + x] < 0 ? -absIntegral : absIntegral };
+	}
 }
@@ -3,6 +3,7 @@
 
 #include "geometry.h"
 #include "pbrt.h"
+#include "sampling.h"
 
 namespace pbrt
 {
@@ -12,8 +13,32 @@ namespace pbrt
 		virtual ~Filter() = default;
 		Filter(const Vector2f& radius);
 		virtual float Evaluate(const Point2f& p) const = 0;
+		// True if Evaluate(x, y) is a product f(x) * g(y)
+		virtual bool IsSeparable() const { return false; }
 		const Vector2f radius, invRadius;
 	};
+
+	struct FilterSample
+	{
+		Point2f p;
+		float weight;
+	};
+
+	// Draws offsets distributed like |f| over the filter's support. The
+	// returned weight f(p) / pdf(p) is constant up to the sign of f, so a
+	// sample only needs to be added to the pixel it was taken for.
+	class FilterSampler
+	{
+	public:
+		FilterSampler(const Filter* filter, int samplesPerRadius = 32);
+		FilterSample Sample(const Point2f& u) const;
+	private:
+		const Bounds2f domain;
+		const int nx, ny;
+		std::vector<float> f;
+		std::unique_ptr<Distribution2D> distrib;
+		float absIntegral;
+	};
 }
 
 #endif
\ No newline at end of file
@@ -1423,6 +1423,58 @@ namespace pbrt
 
 		return po;
 	}
+
+	// Set of directions within an angle of a central direction, stored as
+	// the cosine of that angle; a cone with cosTheta of -1 covers all
+	// directions and one with cosTheta of Infinity is empty
+	struct DirectionCone
+	{
+		DirectionCone() = default;
+		DirectionCone(const Vector3f& w, float cosTheta)
+			: w(Normalize(w)), cosTheta(cosTheta) {}
+		explicit DirectionCone(const Vector3f& w) : DirectionCone(w, 1) {}
+		static DirectionCone EntireSphere()
+		{
+			return DirectionCone(Vector3f(0, 0, 1), -1);
+		}
+		bool IsEmpty() const { return cosTheta == Infinity; }
+		Vector3f w;
+		float cosTheta = Infinity;
+	};
+
+	// Smallest cone holding both _a_ and _b_
+	inline DirectionCone Union(const DirectionCone& a, const DirectionCone& b)
+	{
+		if (a.IsEmpty()) return b;
+		if (b.IsEmpty()) return a;
+		float thetaA = std::acos(Clamp(a.cosTheta, -1, 1));
+		float thetaB = std::acos(Clamp(b.cosTheta, -1, 1));
+		float thetaD = std::acos(Clamp(Dot(a.w, b.w), -1, 1));
+		if (std::min(thetaD + thetaB, Pi) <= thetaA) return a;
+		if (std::min(thetaD + thetaA, Pi) <= thetaB) return b;
+		float thetaO = (thetaA + thetaD + thetaB) / 2;
+		if (thetaO >= Pi) return DirectionCone::EntireSphere();
+		// Rotate a.w toward b.w about their common perpendicular
+		Vector3f wr = Cross(a.w, b.w);
+		if (wr.LengthSquared() == 0) return DirectionCone::EntireSphere();
+		wr = Normalize(wr);
+		float thetaR = thetaO - thetaA;
+		Vector3f w = std::cos(thetaR) * a.w + std::sin(thetaR) * Cross(wr, a.w);
+		return DirectionCone(w, std::cos(thetaO));
+	}
+
+	// Cone of directions from _p_ that reach _b_
+	inline DirectionCone BoundSubtendedDirections(const Bounds3f& b, const Point3f& p)
+	{
+		Point3f pCenter;
+		float radius;
+		b.BoundingSphere(&pCenter, &radius);
+		if (DistanceSquared(p, pCenter) < radius * radius)
+			return DirectionCone::EntireSphere();
+		Vector3f w = pCenter - p;
+		float sin2ThetaMax = radius * radius / DistanceSquared(pCenter, p);
+		return DirectionCone(w, std::sqrt(std::max(0.f, 1 - sin2ThetaMax)));
+	}
 }
 
 #endif
@@ -1,5 +1,7 @@
 #include "imageio.h"
 #include "spectrum.h"
+#include "fileutil.h"
+#include "parallel.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stbimage.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -34,14 +36,443 @@ namespace pbrt
         return std::move(ret);
 	}
 
+	template <typename GetValue>
+	static void WritePNG(const std::string& name, const Vector2i& resolution,
+		GetValue value)
+	{
+		// Gamma-correct and quantize to 8 bits
+		const int n = 3 * resolution.x * resolution.y;
+		std::unique_ptr<uint8_t[]> rgb8(new uint8_t[n]);
+		for (int i = 0; i < n; ++i)
+			rgb8[i] = static_cast<uint8_t>(
+				Clamp(255.f * GammaCorrect(value(i)) + 0.5f, 0.f, 255.f));
+		if (!stbi_write_png(name.c_str(), resolution.x, resolution.y, 3,
+			rgb8.get(), 3 * resolution.x))
+			Error("Error writing output image \"%s\"", name.c_str());
+	}
+
 	void WriteImage(const std::string& name, const float* rgb, const Bounds2i& outputBounds,
 		const Point2i& totalResolution)
 	{
-        if (!stbi_write_hdr(
-            name.c_str(), totalResolution.x, totalResolution.y, 3, rgb))
-        {
-            Error("Write image error");
-        }
-        return;
+		Vector2i resolution = outputBounds.Diagonal();
+		if (HasExtension(name, ".exr"))
+		{
+			std::vector<ImageChannel> channels(3);
+			const char* channelNames[3] = { "R", "G", "B" };
+			for (int c = 0; c < 3; ++c)
+			{
+				channels[c].name = channelNames[c];
+				channels[c].data = rgb + c;
+				channels[c].stride = 3;
+			}
+			WriteEXR(name, std::move(channels), outputBounds, totalResolution);
+		}
+		else if (HasExtension(name, ".png"))
+			WritePNG(name, resolution, [&](int i) { return rgb[i]; });
+		else if (!stbi_write_hdr(name.c_str(), resolution.x, resolution.y, 3, rgb))
+			Error("Error writing output image \"%s\"", name.c_str());
+	}
+
+	void WriteImage(const std::string& name, const uint16_t* rgbHalf, const Bounds2i& outputBounds,
+		const Point2i& totalResolution)
+	{
+		Vector2i resolution = outputBounds.Diagonal();
+		if (HasExtension(name, ".exr"))
+		{
+			std::vector<ImageChannel> channels(3);
+			const char* channelNames[3] = { "R", "G", "B" };
+			for (int c = 0; c < 3; ++c)
+			{
+				channels[c].name = channelNames[c];
+				channels[c].halfData = rgbHalf + c;
+				channels[c].stride = 3;
+			}
+			WriteEXR(name, std::move(channels), outputBounds, totalResolution);
+			return;
+		}
+		if (HasExtension(name, ".png"))
+		{
+			WritePNG(name, resolution, [&](int i) { return HalfToFloat(rgbHalf[i]); });
+			return;
+		}
+
+		// Write uncompressed Radiance RGBE one pixel at a time
+		FILE* f = fopen(name.c_str(), "wb");
+		if (!f)
+		{
+			Error("Unable to open output image file \"%s\"", name.c_str());
+			return;
+		}
+		fprintf(f, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n",
+			resolution.y, resolution.x);
+		std::vector<unsigned char> scanline(4 * resolution.x);
+		for (int y = 0; y < resolution.y; ++y)
+		{
+			for (int x = 0; x < resolution.x; ++x)
+			{
+				const uint16_t* h = &rgbHalf[3 * (y * resolution.x + x)];
+				float rgb[3];
+				for (int c = 0; c < 3; ++c)
+					rgb[c] = std::min(HalfToFloat(h[c]), 65504.f);
+				float maxComponent = std::max(rgb[0], std::max(rgb[1], rgb[2]));
+				unsigned char* rgbe = &scanline[4 * x];
+				if (!(maxComponent > 1e-32f))
+					rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+				else
+				{
+					int exponent;
+					float s = std::frexp(maxComponent, &exponent) * 256.f / maxComponent;
+					for (int c = 0; c < 3; ++c)
+						rgbe[c] = (unsigned char)std::max(0.f, rgb[c] * s);
+					rgbe[3] = (unsigned char)(exponent + 128);
+				}
+			}
+			fwrite(&scanline[0], 1, scanline.size(), f);
+		}
+		if (fclose(f) != 0)
+			Error("Error writing output image \"%s\"", name.c_str());
+	}
+
+	// OpenEXR is little-endian throughout, as are the hosts pbrt targets
+	template <typename T>
+	static void EXRPut(std::vector<uint8_t>* buf, T value)
+	{
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+		buf->insert(buf->end(), bytes, bytes + sizeof(T));
+	}
+
+	static void EXRPutAttribute(std::vector<uint8_t>* buf, const char* name,
+		const char* type, const std::vector<uint8_t>& value)
+	{
+		buf->insert(buf->end(), name, name + strlen(name) + 1);
+		buf->insert(buf->end(), type, type + strlen(type) + 1);
+		EXRPut<int32_t>(buf, static_cast<int32_t>(value.size()));
+		buf->insert(buf->end(), value.begin(), value.end());
+	}
+
+	// Run-length encoding as done by OpenEXR's RLE compressor: a count
+	// byte n >= 0 repeats the next byte n + 1 times, while n < 0 is
+	// followed by -n literal bytes
+	static size_t EXRRunLengthEncode(const uint8_t* in, size_t n, uint8_t* out)
+	{
+		const int minRunLength = 3, maxRunLength = 127;
+		const uint8_t* inEnd = in + n;
+		const uint8_t* runStart = in;
+		uint8_t* outStart = out;
+		while (runStart < inEnd)
+		{
+			const uint8_t* runEnd = runStart + 1;
+			while (runEnd < inEnd && *runStart == *runEnd &&
+				runEnd - runStart - 1 < maxRunLength)
+				++runEnd;
+			if (runEnd - runStart >= minRunLength)
+			{
+				*out++ = static_cast<uint8_t>((runEnd - runStart) - 1);
+				*out++ = *runStart;
+				runStart = runEnd;
+			}
+			else
+			{
+				// Extend the literal run until a repeat of three bytes starts
+				while (runEnd < inEnd &&
+					((runEnd + 1 >= inEnd || *runEnd != *(runEnd + 1)) ||
+					 (runEnd + 2 >= inEnd || *(runEnd + 1) != *(runEnd + 2))) &&
+					runEnd - runStart < maxRunLength)
+					++runEnd;
+				*out++ = static_cast<uint8_t>(runStart - runEnd);
+				while (runStart < runEnd)
+					*out++ = *runStart++;
+			}
+		}
+		return out - outStart;
+	}
+
+	static std::vector<uint8_t> EXREncodeChunk(const std::vector<uint8_t>& raw,
+		EXRCompression compression)
+	{
+		if (compression == EXRCompression::None)
+			return raw;
+
+		// Split even and odd bytes apart and delta-encode them, which lets
+		// the high and low bytes of similar values compress together
+		const size_t n = raw.size();
+		std::vector<uint8_t> predicted(n);
+		uint8_t* even = &predicted[0];
+		uint8_t* odd = &predicted[(n + 1) / 2];
+		for (size_t i = 0; i < n; ++i)
+			(i & 1 ? *odd++ : *even++) = raw[i];
+		int prev = predicted[0];
+		for (size_t i = 1; i < n; ++i)
+		{
+			int d = int(predicted[i]) - prev + (128 + 256);
+			prev = predicted[i];
+			predicted[i] = static_cast<uint8_t>(d);
+		}
+
+		std::vector<uint8_t> packed;
+		if (compression == EXRCompression::RLE)
+		{
+			packed.resize(n + n / 127 + 2);
+			packed.resize(EXRRunLengthEncode(&predicted[0], n, &packed[0]));
+		}
+		else
+		{
+			int zlibLength;
+			uint8_t* zlib = stbi_zlib_compress(&predicted[0], static_cast<int>(n),
+				&zlibLength, 8);
+			if (zlib)
+			{
+				packed.assign(zlib, zlib + zlibLength);
+				STBIW_FREE(zlib);
+			}
+		}
+		// Chunks that do not shrink are stored uncompressed
+		if (packed.empty() || packed.size() >= n)
+			return raw;
+		return packed;
+	}
+
+	// Builds the header of a scanline file; _channels_ must be sorted by name
+	static std::vector<uint8_t> EXRHeader(const std::vector<ImageChannel>& channels,
+		const Bounds2i& outputBounds, const Point2i& totalResolution,
+		EXRCompression compression)
+	{
+		std::vector<uint8_t> header;
+		EXRPut<int32_t>(&header, 20000630);
+		EXRPut<int32_t>(&header, 2);
+		std::vector<uint8_t> value;
+		for (const ImageChannel& channel : channels)
+		{
+			value.insert(value.end(), channel.name.begin(), channel.name.end());
+			value.push_back(0);
+			bool half = channel.halfData || channel.storeHalf;
+			EXRPut<int32_t>(&value, half ? 1 : 2);
+			EXRPut<int32_t>(&value, 0);
+			EXRPut<int32_t>(&value, 1);
+			EXRPut<int32_t>(&value, 1);
+		}
+		value.push_back(0);
+		EXRPutAttribute(&header, "channels", "chlist", value);
+		const uint8_t compressionCode[] = { 0, 1, 3 };
+		EXRPutAttribute(&header, "compression", "compression",
+			{ compressionCode[static_cast<int>(compression)] });
+		value.clear();
+		EXRPut<int32_t>(&value, outputBounds.pMin.x);
+		EXRPut<int32_t>(&value, outputBounds.pMin.y);
+		EXRPut<int32_t>(&value, outputBounds.pMax.x - 1);
+		EXRPut<int32_t>(&value, outputBounds.pMax.y - 1);
+		EXRPutAttribute(&header, "dataWindow", "box2i", value);
+		value.clear();
+		EXRPut<int32_t>(&value, 0);
+		EXRPut<int32_t>(&value, 0);
+		EXRPut<int32_t>(&value, totalResolution.x - 1);
+		EXRPut<int32_t>(&value, totalResolution.y - 1);
+		EXRPutAttribute(&header, "displayWindow", "box2i", value);
+		EXRPutAttribute(&header, "lineOrder", "lineOrder", { 0 });
+		value.clear();
+		EXRPut<float>(&value, 1.f);
+		EXRPutAttribute(&header, "pixelAspectRatio", "float", value);
+		value.clear();
+		EXRPut<float>(&value, 0.f);
+		EXRPut<float>(&value, 0.f);
+		EXRPutAttribute(&header, "screenWindowCenter", "v2f", value);
+		value.clear();
+		EXRPut<float>(&value, 1.f);
+		EXRPutAttribute(&header, "screenWindowWidth", "float", value);
+		header.push_back(0);
+		return header;
+	}
+
+	static int EXRLinesPerChunk(EXRCompression compression)
+	{
+		return compression == EXRCompression::ZIP ? 16 : 1;
+	}
+
+	// Encodes rows [y0, y1) of the channels' data as one chunk whose lines
+	// start at _fileY_ in the file's coordinates
+	static std::vector<uint8_t> EXRChunk(const std::vector<ImageChannel>& channels,
+		int width, int y0, int y1, int fileY, EXRCompression compression)
+	{
+		std::vector<uint8_t> raw;
+		for (int y = y0; y < y1; ++y)
+			for (const ImageChannel& channel : channels)
+				for (int x = 0; x < width; ++x)
+				{
+					size_t index = size_t(channel.stride) * (size_t(y) * width + x);
+					if (channel.halfData)
+						EXRPut<uint16_t>(&raw, channel.halfData[index]);
+					else if (channel.storeHalf)
+						EXRPut<uint16_t>(&raw, FloatToHalf(channel.data[index]));
+					else
+						EXRPut<float>(&raw, channel.data[index]);
+				}
+		std::vector<uint8_t> packed = EXREncodeChunk(raw, compression);
+		std::vector<uint8_t> chunk;
+		chunk.reserve(8 + packed.size());
+		EXRPut<int32_t>(&chunk, fileY);
+		EXRPut<int32_t>(&chunk, static_cast<int32_t>(packed.size()));
+		chunk.insert(chunk.end(), packed.begin(), packed.end());
+		return chunk;
+	}
+
+	void WriteEXR(const std::string& name, std::vector<ImageChannel> channels,
+		const Bounds2i& outputBounds, const Point2i& totalResolution,
+		EXRCompression compression)
+	{
+		const Vector2i resolution = outputBounds.Diagonal();
+		if (resolution.x <= 0 || resolution.y <= 0 || channels.empty())
+		{
+			Error("Nothing to write to \"%s\"", name.c_str());
+			return;
+		}
+		// OpenEXR requires channels sorted by name
+		std::sort(channels.begin(), channels.end(),
+			[](const ImageChannel& a, const ImageChannel& b) { return a.name < b.name; });
+		std::vector<uint8_t> header = EXRHeader(channels, outputBounds,
+			totalResolution, compression);
+
+		// Encode chunks in parallel; each holds all channels of its lines
+		const int linesPerChunk = EXRLinesPerChunk(compression);
+		const int nChunks = (resolution.y + linesPerChunk - 1) / linesPerChunk;
+		std::vector<std::vector<uint8_t>> chunks(nChunks);
+		ParallelFor([&](int64_t c) {
+			const int y0 = c * linesPerChunk;
+			const int y1 = std::min(y0 + linesPerChunk, resolution.y);
+			chunks[c] = EXRChunk(channels, resolution.x, y0, y1,
+				outputBounds.pMin.y + y0, compression);
+		}, nChunks);
+
+		// Write the header, the chunk offset table and the chunks
+		std::vector<uint8_t> offsets;
+		uint64_t offset = header.size() + sizeof(uint64_t) * nChunks;
+		for (const std::vector<uint8_t>& chunk : chunks)
+		{
+			EXRPut<uint64_t>(&offsets, offset);
+			offset += chunk.size();
+		}
+		FILE* f = fopen(name.c_str(), "wb");
+		if (!f)
+		{
+			Error("Unable to open output image file \"%s\"", name.c_str());
+			return;
+		}
+		bool ok = fwrite(&header[0], 1, header.size(), f) == header.size() &&
+			fwrite(&offsets[0], 1, offsets.size(), f) == offsets.size();
+		for (const std::vector<uint8_t>& chunk : chunks)
+			ok = ok && fwrite(&chunk[0], 1, chunk.size(), f) == chunk.size();
+		if (fclose(f) != 0 || !ok)
+			Error("Error writing output image \"%s\"", name.c_str());
+	}
+
+	EXRScanlineWriter::EXRScanlineWriter(const std::string& name,
+		const std::vector<std::string>& channelNames, bool storeHalf,
+		const Bounds2i& outputBounds, const Point2i& totalResolution,
+		EXRCompression compression)
+		: name(name), outputBounds(outputBounds), compression(compression),
+		  nChannels(static_cast<int>(channelNames.size())),
+		  width(outputBounds.Diagonal().x), height(outputBounds.Diagonal().y),
+		  linesPerChunk(EXRLinesPerChunk(compression))
+	{
+		// Channels are stored sorted by name; _channelIndex_ maps them back
+		// to their position in the interleaved input
+		for (int c = 0; c < nChannels; ++c)
+			channelIndex.push_back(c);
+		std::sort(channelIndex.begin(), channelIndex.end(),
+			[&](int a, int b) { return channelNames[a] < channelNames[b]; });
+		for (int c = 0; c < nChannels; ++c)
+		{
+			ImageChannel channel;
+			channel.name = channelNames[channelIndex[c]];
+			channel.stride = nChannels;
+			channel.storeHalf = storeHalf;
+			channels.push_back(channel);
+		}
+
+		std::vector<uint8_t> header = EXRHeader(channels, outputBounds,
+			totalResolution, compression);
+		file = fopen(name.c_str(), "wb");
+		if (!file)
+		{
+			Error("Unable to open output image file \"%s\"", name.c_str());
+			return;
+		}
+		// Leave room for the offset table, which is filled in by Close()
+		nChunks = (height + linesPerChunk - 1) / linesPerChunk;
+		offsetTablePosition = header.size();
+		std::vector<uint8_t> table(sizeof(uint64_t) * nChunks, 0);
+		fileOffset = header.size() + table.size();
+		ok = fwrite(&header[0], 1, header.size(), file) == header.size() &&
+			(table.empty() || fwrite(&table[0], 1, table.size(), file) == table.size());
+	}
+
+	// fseek() takes a long, which is 32 bits on Windows
+	static bool SeekFile(FILE* file, uint64_t offset)
+	{
+#if defined(PBRT_IS_WINDOWS)
+		return _fseeki64(file, static_cast<int64_t>(offset), SEEK_SET) == 0;
+#else
+		return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+	}
+
+	EXRScanlineWriter::~EXRScanlineWriter()
+	{
+		Close();
+	}
+
+	void EXRScanlineWriter::AddRows(const float* data, int nRows)
+	{
+		pending.insert(pending.end(), data, data + size_t(nRows) * width * nChannels);
+		WriteChunks(false);
+	}
+
+	void EXRScanlineWriter::WriteChunks(bool final)
+	{
+		if (!file)
+			return;
+		// Encode all complete chunks, and the final partial one, in parallel
+		const int pendingRows = static_cast<int>(pending.size() / (size_t(width) * nChannels));
+		int nEncode = pendingRows / linesPerChunk;
+		if (final && pendingRows % linesPerChunk != 0)
+			++nEncode;
+		if (nEncode == 0)
+			return;
+		std::vector<ImageChannel> pendingChannels = channels;
+		for (int c = 0; c < nChannels; ++c)
+			pendingChannels[c].data = &pending[channelIndex[c]];
+		std::vector<std::vector<uint8_t>> chunks(nEncode);
+		ParallelFor([&](int64_t c) {
+			const int y0 = c * linesPerChunk;
+			const int y1 = std::min(y0 + linesPerChunk, pendingRows);
+			chunks[c] = EXRChunk(pendingChannels, width, y0, y1,
+				outputBounds.pMin.y + rowsWritten + y0, compression);
+		}, nEncode);
+		for (const std::vector<uint8_t>& chunk : chunks)
+		{
+			offsets.push_back(fileOffset);
+			fileOffset += chunk.size();
+			ok = ok && fwrite(&chunk[0], 1, chunk.size(), file) == chunk.size();
+		}
+		const int rowsEncoded = std::min(nEncode * linesPerChunk, pendingRows);
+		rowsWritten += rowsEncoded;
+		pending.erase(pending.begin(), pending.begin() + size_t(rowsEncoded) * width * nChannels);
+	}
+
+	void EXRScanlineWriter::Close()
+	{
+		if (!file)
+			return;
+		WriteChunks(true);
+		if (rowsWritten != height)
+			Warning("Only %d of %d rows were written to \"%s\"", rowsWritten,
+				height, name.c_str());
+		std::vector<uint8_t> table;
+		for (uint64_t offset : offsets)
+			EXRPut<uint64_t>(&table, offset);
+		ok = ok && SeekFile(file, offsetTablePosition) &&
+			(table.empty() || fwrite(&table[0], 1, table.size(), file) == table.size());
+		if (fclose(file) != 0 || !ok)
+			Error("Error writing output image \"%s\"", name.c_str());
+		file = nullptr;
 	}
 }
@@ -9,7 +9,64 @@ namespace pbrt
 {
 	std::unique_ptr<RGBSpectrum[]> ReadImage(const std::string& name,
 		Point2i* resolution);
+	// Both WriteImage() variants pick the format from the filename's
+	// extension: OpenEXR for ".exr", 8-bit sRGB for ".png" and Radiance
+	// RGBE otherwise
 	void WriteImage(const std::string& name, const float* rgb, const Bounds2i& outputBounds, const Point2i& totalResolution);
+	// Writes a half-float image without expanding it to a float copy
+	void WriteImage(const std::string& name, const uint16_t* rgbHalf, const Bounds2i& outputBounds, const Point2i& totalResolution);
+
+	// A channel of an image passed to WriteEXR(). Pixel (x, y) of the
+	// output bounds is read from data[stride * (y * width + x)], from
+	// either _data_ or _halfData_.
+	struct ImageChannel
+	{
+		std::string name;
+		const float* data = nullptr;
+		const uint16_t* halfData = nullptr;
+		int stride = 1;
+		// Store float data as half in the file
+		bool storeHalf = false;
+	};
+
+	enum class EXRCompression { None, RLE, ZIP };
+
+	// Writes a scanline OpenEXR file whose data window is _outputBounds_,
+	// compressing its chunks in parallel
+	void WriteEXR(const std::string& name, std::vector<ImageChannel> channels,
+		const Bounds2i& outputBounds, const Point2i& totalResolution,
+		EXRCompression compression = EXRCompression::ZIP);
+
+	// Writes a scanline OpenEXR file a few rows at a time, so the image
+	// never has to be in memory as a whole. Rows are added top to bottom
+	// as interleaved floats, one value per channel in _channelNames_ order.
+	class EXRScanlineWriter
+	{
+	public:
+		EXRScanlineWriter(const std::string& name,
+			const std::vector<std::string>& channelNames, bool storeHalf,
+			const Bounds2i& outputBounds, const Point2i& totalResolution,
+			EXRCompression compression = EXRCompression::ZIP);
+		~EXRScanlineWriter();
+		void AddRows(const float* data, int nRows);
+		// Writes any remaining rows and the chunk offset table
+		void Close();
+	private:
+		void WriteChunks(bool final);
+		const std::string name;
+		const Bounds2i outputBounds;
+		const EXRCompression compression;
+		const int nChannels, width, height, linesPerChunk;
+		std::vector<ImageChannel> channels;
+		std::vector<int> channelIndex;
+		std::vector<float> pending;
+		std::vector<uint64_t> offsets;
+		FILE* file = nullptr;
+		int nChunks = 0, rowsWritten = 0;
+		size_t offsetTablePosition = 0;
+		uint64_t fileOffset = 0;
+		bool ok = true;
+	};
 }
 
 #endif
\ No newline at end of file
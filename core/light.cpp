@@ -6,6 +6,68 @@ namespace pbrt
 	void Light::Preprocess(const Scene& scene)
 	{ }
 
+	Spectrum Light::Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+		Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const
+	{
+		*pdfPos = *pdfDir = 0;
+		return Spectrum(0.f);
+	}
+
+	float LightBounds::Importance(const Point3f& p, const Normal3f& n) const
+	{
+		// Distance to the bounds' center, clamped so that points inside the
+		// bounds don't get unbounded importance
+		Point3f pc = (bounds.pMin + bounds.pMax) * .5f;
+		float d2 = DistanceSquared(p, pc);
+		Vector3f wi = d2 > 0 ? Normalize(p - pc) : Vector3f(0, 0, 1);
+		d2 = std::max(d2, bounds.Diagonal().Length() / 2);
+
+		// cos(max(0, a - b)) and sin(max(0, a - b)) from sines and cosines
+		auto cosSubClamped = [](float sinA, float cosA, float sinB, float cosB) {
+			return cosA > cosB ? 1.f : cosA * cosB + sinA * sinB;
+		};
+		auto sinSubClamped = [](float sinA, float cosA, float sinB, float cosB) {
+			return cosA > cosB ? 0.f : sinA * cosB - cosA * sinB;
+		};
+		auto sinFromCos = [](float c) { return std::sqrt(std::max(0.f, 1 - c * c)); };
+
+		// Smallest angle between the emission cone and the direction to _p_,
+		// widened by the angle the bounds subtend from _p_
+		float cosThetaW = Dot(w, wi);
+		if (twoSided)
+			cosThetaW = std::abs(cosThetaW);
+		float sinThetaW = sinFromCos(cosThetaW);
+		float cosThetaB = BoundSubtendedDirections(bounds, p).cosTheta;
+		float sinThetaB = sinFromCos(cosThetaB);
+		float sinThetaO = sinFromCos(cosThetaO);
+		float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+		float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+		float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+		if (cosThetaP <= cosThetaE)
+			return 0;
+		float importance = phi * cosThetaP / d2;
+
+		// Account for the receiver's cosine factor
+		if (n != Normal3f(0, 0, 0))
+		{
+			float cosThetaI = AbsDot(wi, n);
+			float sinThetaI = sinFromCos(cosThetaI);
+			importance *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+		}
+		return std::max(importance, 0.f);
+	}
+
+	LightBounds Union(const LightBounds& a, const LightBounds& b)
+	{
+		if (a.phi == 0) return b;
+		if (b.phi == 0) return a;
+		DirectionCone cone = Union(DirectionCone(a.w, a.cosThetaO),
+			DirectionCone(b.w, b.cosThetaO));
+		return LightBounds(Union(a.bounds, b.bounds), cone.w, a.phi + b.phi,
+			cone.cosTheta, std::min(a.cosThetaE, b.cosThetaE),
+			a.twoSided || b.twoSided);
+	}
+
 	VisibilityTester::VisibilityTester() = default;
 
 	VisibilityTester::VisibilityTester(const Interaction& p0, const Interaction& p1):p0(p0), p1(p1)
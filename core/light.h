@@ -16,6 +16,30 @@ namespace pbrt
                flags & (int)LightFlags::DeltaDirection;
     }
 
+	// Bounds on where a light is and where it emits, for building light
+	// hierarchies: it lies in _bounds_, its surface normals are within
+	// _cosThetaO_ of _w_, and it emits within a further _cosThetaE_ of
+	// those. _phi_ scales the light's intensity, so that phi * cos / d^2
+	// estimates the irradiance it gives at distance d.
+	struct LightBounds
+	{
+		LightBounds() = default;
+		LightBounds(const Bounds3f& bounds, const Vector3f& w, float phi,
+			float cosThetaO, float cosThetaE, bool twoSided)
+			: bounds(bounds), w(Normalize(w)), phi(phi), cosThetaO(cosThetaO),
+			  cosThetaE(cosThetaE), twoSided(twoSided) {}
+		// Conservative estimate of the light's contribution at _p_ on a
+		// surface with normal _n_; _n_ is zero for points in media
+		float Importance(const Point3f& p, const Normal3f& n) const;
+		Bounds3f bounds;
+		Vector3f w;
+		float phi = 0;
+		float cosThetaO = 1, cosThetaE = 1;
+		bool twoSided = false;
+	};
+
+	LightBounds Union(const LightBounds& a, const LightBounds& b);
+
 	class Light
 	{
 	public:
@@ -29,6 +53,14 @@ namespace pbrt
 			Vector3f* wi, float* pdf,
 			VisibilityTester* vis) const = 0;
 		virtual float Pdf_Li(const Interaction& ref, const Vector3f& wi) const = 0;
+		// Samples a ray leaving the light, for tracing paths from lights;
+		// _pdfPos_ and _pdfDir_ are the densities of its origin and of its
+		// direction. Lights that can't start paths return no radiance.
+		virtual Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+			Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const;
+		// Returns false for lights that are not bounded in space, such as
+		// infinite and distant lights
+		virtual bool GetBounds(LightBounds* bounds) const { return false; }
 		const int flags;
 		const int nSamples;
 		const MediumInterface mediumInterface;
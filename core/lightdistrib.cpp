@@ -0,0 +1,478 @@
+#include "lightdistrib.h"
+
+#include "light.h"
+#include "parallel.h"
+#include "rng.h"
+#include "scene.h"
+#include "stats.h"
+#include <functional>
+#include <thread>
+
+namespace pbrt
+{
+	STAT_COUNTER("SpatialLightDistribution/Distributions created", nCreated);
+	STAT_COUNTER("SpatialLightDistribution/Lookups", nLookups);
+	STAT_COUNTER("SpatialLightDistribution/Hash probes", nProbes);
+	STAT_COUNTER("BVHLightDistribution/Bounded lights", nBoundedLights);
+	STAT_COUNTER("BVHLightDistribution/Unbounded lights", nUnboundedLights);
+
+	// Lights with no power would give a distribution that sums to zero
+	static std::unique_ptr<Distribution1D> MakeLightDistribution(std::vector<float> weights)
+	{
+		float sum = 0;
+		for (float w : weights)
+			sum += w;
+		if (!(sum > 0))
+			std::fill(weights.begin(), weights.end(), 1.f);
+		return std::make_unique<Distribution1D>(weights.data(), int(weights.size()));
+	}
+
+	UniformLightDistribution::UniformLightDistribution(const Scene& scene)
+		: distrib(MakeLightDistribution(std::vector<float>(scene.lights.size(), 1.f))) {}
+
+	const Distribution1D* UniformLightDistribution::Lookup(const Point3f& p) const
+	{
+		return distrib.get();
+	}
+
+	PowerLightDistribution::PowerLightDistribution(const Scene& scene)
+	{
+		std::vector<float> power;
+		for (const auto& light : scene.lights)
+			power.push_back(light->Power().y());
+		distrib = MakeLightDistribution(std::move(power));
+	}
+
+	const Distribution1D* PowerLightDistribution::Lookup(const Point3f& p) const
+	{
+		return distrib.get();
+	}
+
+	// Voxel coordinates are packed 20 bits each into a hash table key;
+	// all ones marks an empty entry
+	static constexpr uint64_t invalidPackedPos = 0xffffffffffffffffull;
+
+	SpatialLightDistribution::SpatialLightDistribution(const Scene& scene, int maxVoxels)
+		: scene(scene)
+	{
+		// Voxels are roughly cubes, with _maxVoxels_ along the longest axis
+		Bounds3f b = scene.Worldbound();
+		Vector3f diag = b.Diagonal();
+		float bmax = diag[b.MaximumExtent()];
+		for (int i = 0; i < 3; ++i)
+			nVoxels[i] = Clamp(int(std::round(diag[i] / bmax * maxVoxels)), 1, (1 << 20) - 1);
+		// Leave room for the voxels that are actually used, at a low load
+		hashTableSize = 4 * size_t(nVoxels[0]) * nVoxels[1] * nVoxels[2];
+		hashTable.reset(new HashEntry[hashTableSize]);
+		for (size_t i = 0; i < hashTableSize; ++i)
+		{
+			hashTable[i].packedPos.store(invalidPackedPos);
+			hashTable[i].distribution.store(nullptr);
+		}
+	}
+
+	SpatialLightDistribution::~SpatialLightDistribution()
+	{
+		for (size_t i = 0; i < hashTableSize; ++i)
+			delete hashTable[i].distribution.load();
+	}
+
+	const Distribution1D* SpatialLightDistribution::Lookup(const Point3f& p) const
+	{
+		++nLookups;
+		// Find the voxel holding _p_
+		Vector3f offset = scene.Worldbound().Offset(p);
+		Point3i pi;
+		for (int i = 0; i < 3; ++i)
+			pi[i] = Clamp(int(offset[i] * nVoxels[i]), 0, nVoxels[i] - 1);
+		uint64_t packedPos = (uint64_t(pi[0]) << 40) | (uint64_t(pi[1]) << 20) | pi[2];
+
+		// Hash the packed position with the finalizer of MurmurHash3
+		uint64_t hash = packedPos;
+		hash ^= hash >> 31;
+		hash *= 0x7fb5d329728ea185ull;
+		hash ^= hash >> 27;
+		hash *= 0x81dadef4bc2dd44dull;
+		hash ^= hash >> 33;
+		hash %= hashTableSize;
+
+		// Probe quadratically for the voxel's entry, claiming an empty one if
+		// no thread has computed the voxel yet
+		for (int step = 1; ; ++step)
+		{
+			++nProbes;
+			HashEntry& entry = hashTable[hash];
+			uint64_t entryPackedPos = entry.packedPos.load(std::memory_order_acquire);
+			if (entryPackedPos == packedPos)
+			{
+				// Another thread may still be computing the distribution
+				Distribution1D* dist;
+				while ((dist = entry.distribution.load(std::memory_order_acquire)) == nullptr)
+					std::this_thread::yield();
+				return dist;
+			}
+			if (entryPackedPos == invalidPackedPos &&
+				entry.packedPos.compare_exchange_strong(entryPackedPos, packedPos))
+			{
+				Distribution1D* dist = ComputeDistribution(pi);
+				entry.distribution.store(dist, std::memory_order_release);
+				return dist;
+			}
+			// Recheck the entry if another thread just claimed it for us
+			if (entryPackedPos == packedPos)
+				continue;
+			hash += step * step;
+			hash %= hashTableSize;
+		}
+	}
+
+	Distribution1D* SpatialLightDistribution::ComputeDistribution(const Point3i& pi) const
+	{
+		++nCreated;
+		// Bounds of the voxel
+		Bounds3f world = scene.Worldbound();
+		Vector3f diag = world.Diagonal();
+		Point3f p0, p1;
+		for (int i = 0; i < 3; ++i)
+		{
+			p0[i] = world.pMin[i] + diag[i] * pi[i] / nVoxels[i];
+			p1[i] = world.pMin[i] + diag[i] * (pi[i] + 1) / nVoxels[i];
+		}
+
+		// Estimate each light's unoccluded contribution from random points
+		// in the voxel; the RNG is seeded by the voxel so that the result
+		// does not depend on which thread computes it
+		const int nSamples = 128;
+		RNG rng((uint64_t(pi[0]) << 40) | (uint64_t(pi[1]) << 20) | pi[2]);
+		std::vector<float> lightContrib(scene.lights.size(), 0.f);
+		for (int i = 0; i < nSamples; ++i)
+		{
+			Point3f p(Lerp(rng.UniformFloat(), p0.x, p1.x),
+				Lerp(rng.UniformFloat(), p0.y, p1.y),
+				Lerp(rng.UniformFloat(), p0.z, p1.z));
+			Interaction intr(p, Normal3f(), Vector3f(), Vector3f(1, 0, 0), 0,
+				MediumInterface());
+			Point2f u(rng.UniformFloat(), rng.UniformFloat());
+			for (size_t j = 0; j < scene.lights.size(); ++j)
+			{
+				float pdf;
+				Vector3f wi;
+				VisibilityTester vis;
+				Spectrum Li = scene.lights[j]->Sample_Li(intr, u, &wi, &pdf, &vis);
+				if (pdf > 0)
+					lightContrib[j] += Li.y() / pdf;
+			}
+		}
+
+		// Keep every light possible, since the points above may all have
+		// missed a light that reaches part of the voxel
+		float avgContrib = 0;
+		for (float c : lightContrib)
+			avgContrib += c;
+		avgContrib /= std::max<size_t>(1, lightContrib.size());
+		float minContrib = avgContrib > 0 ? .001f * avgContrib : 1;
+		for (float& c : lightContrib)
+			c = std::max(c, minContrib);
+		return new Distribution1D(lightContrib.data(), int(lightContrib.size()));
+	}
+
+	BVHLightDistribution::BVHLightDistribution(const std::vector<std::shared_ptr<Light>>& lights)
+		: lightGroup(lights.size(), LightGroup::None), lightBitTrail(lights.size(), 0)
+	{
+		// Gather the lights' bounds in parallel, since for large meshes of
+		// emissive triangles there are many of them
+		std::vector<LightBounds> bounds(lights.size());
+		std::vector<uint8_t> hasBounds(lights.size());
+		ParallelFor([&](int64_t i) {
+			hasBounds[i] = lights[i]->GetBounds(&bounds[i]);
+			}, lights.size(), 1024);
+		std::vector<BVHLight> bvhLights;
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			if (!hasBounds[i])
+			{
+				unboundedLights.push_back(int(i));
+				lightGroup[i] = LightGroup::Unbounded;
+				++nUnboundedLights;
+			}
+			else if (bounds[i].phi > 0)
+			{
+				const Bounds3f& b = bounds[i].bounds;
+				bvhLights.push_back({ int(i), bounds[i], (b.pMin + b.pMax) * .5f });
+				lightGroup[i] = LightGroup::Hierarchy;
+				++nBoundedLights;
+			}
+		}
+		if (bvhLights.empty())
+			return;
+
+		// Partition the top of the hierarchy serially into subtrees, which
+		// are then built in parallel and copied into _nodes_ in depth-first
+		// order
+		struct Subtree
+		{
+			int start, end;
+			uint64_t bitTrail;
+			int depth;
+			std::vector<LightBVHNode> nodes;
+		};
+		struct TopNode
+		{
+			// Index into _subtrees_, or -1 for interior nodes
+			int subtree;
+			int secondChild;
+		};
+		std::vector<Subtree> subtrees;
+		std::vector<TopNode> top;
+		const int maxSubtreeSize = std::max<int>(256,
+			int(bvhLights.size()) / (4 * std::max(1, MaxThreadIndex())));
+		std::function<void(int, int, uint64_t, int)> splitTop =
+			[&](int start, int end, uint64_t bitTrail, int depth) {
+			if (end - start <= maxSubtreeSize)
+			{
+				top.push_back({ int(subtrees.size()), -1 });
+				subtrees.push_back({ start, end, bitTrail, depth, {} });
+				return;
+			}
+			int mid = Partition(bvhLights, start, end, depth);
+			int nodeIndex = int(top.size());
+			top.push_back({ -1, -1 });
+			splitTop(start, mid, bitTrail, depth + 1);
+			top[nodeIndex].secondChild = int(top.size());
+			splitTop(mid, end, bitTrail | (uint64_t(1) << depth), depth + 1);
+		};
+		splitTop(0, int(bvhLights.size()), 0, 0);
+		ParallelFor([&](int64_t i) {
+			Subtree& st = subtrees[i];
+			BuildSubtree(bvhLights, st.start, st.end, st.bitTrail, st.depth, &st.nodes);
+			}, subtrees.size(), 1);
+
+		std::function<LightBounds(int)> emitTop = [&](int t) -> LightBounds {
+			if (top[t].subtree >= 0)
+			{
+				const std::vector<LightBVHNode>& subtreeNodes = subtrees[top[t].subtree].nodes;
+				int offset = int(nodes.size());
+				for (LightBVHNode node : subtreeNodes)
+				{
+					if (!node.isLeaf)
+						node.childOrLightIndex += offset;
+					nodes.push_back(node);
+				}
+				return subtreeNodes[0].bounds;
+			}
+			int nodeIndex = int(nodes.size());
+			nodes.push_back(LightBVHNode());
+			LightBounds b0 = emitTop(t + 1);
+			int secondChild = int(nodes.size());
+			LightBounds b1 = emitTop(top[t].secondChild);
+			nodes[nodeIndex] = { Union(b0, b1), secondChild, false };
+			return nodes[nodeIndex].bounds;
+		};
+		emitTop(0);
+	}
+
+	// Cost of a node for the surface area and orientation heuristic: its
+	// power times the solid angle it emits into, times the area of its
+	// bounds, penalized for being thin along the split axis
+	static float EvaluateCost(const LightBounds& b, const Bounds3f& bounds, int dim)
+	{
+		float thetaO = std::acos(Clamp(b.cosThetaO, -1, 1));
+		float thetaE = std::acos(Clamp(b.cosThetaE, -1, 1));
+		float thetaW = std::min(thetaO + thetaE, Pi);
+		float sinThetaO = std::sqrt(std::max(0.f, 1 - b.cosThetaO * b.cosThetaO));
+		float mOmega = 2 * Pi * (1 - b.cosThetaO) +
+			Pi / 2 * (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW) -
+				2 * thetaO * sinThetaO + b.cosThetaO);
+		Vector3f d = bounds.Diagonal();
+		float kr = MaxComponent(d) / d[dim];
+		return b.phi * mOmega * kr * b.bounds.SurfaceArea();
+	}
+
+	int BVHLightDistribution::Partition(std::vector<BVHLight>& bvhLights, int start,
+		int end, int depth) const
+	{
+		Bounds3f bounds, centroidBounds;
+		for (int i = start; i < end; ++i)
+		{
+			bounds = Union(bounds, bvhLights[i].bounds.bounds);
+			centroidBounds = Union(centroidBounds, bvhLights[i].centroid);
+		}
+
+		// Below half the depth a bit trail can hold, split with the cost
+		// heuristic over buckets of centroids along each axis
+		if (depth < 32)
+		{
+			constexpr int nBuckets = 12;
+			float minCost = Infinity;
+			int minDim = -1, minBucket = -1;
+			auto bucketOf = [&](const BVHLight& l, int dim) {
+				float o = centroidBounds.Offset(l.centroid)[dim];
+				return std::min(int(nBuckets * o), nBuckets - 1);
+			};
+			for (int dim = 0; dim < 3; ++dim)
+			{
+				if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+					continue;
+				LightBounds bucketBounds[nBuckets];
+				for (int i = start; i < end; ++i)
+				{
+					int b = bucketOf(bvhLights[i], dim);
+					bucketBounds[b] = Union(bucketBounds[b], bvhLights[i].bounds);
+				}
+				for (int split = 0; split < nBuckets - 1; ++split)
+				{
+					LightBounds below, above;
+					for (int b = 0; b <= split; ++b)
+						below = Union(below, bucketBounds[b]);
+					for (int b = split + 1; b < nBuckets; ++b)
+						above = Union(above, bucketBounds[b]);
+					float cost = EvaluateCost(below, bounds, dim) +
+						EvaluateCost(above, bounds, dim);
+					if (cost > 0 && cost < minCost)
+					{
+						minCost = cost;
+						minDim = dim;
+						minBucket = split;
+					}
+				}
+			}
+			if (minDim >= 0)
+			{
+				BVHLight* pmid = std::partition(&bvhLights[start], &bvhLights[end - 1] + 1,
+					[&](const BVHLight& l) { return bucketOf(l, minDim) <= minBucket; });
+				int mid = int(pmid - &bvhLights[0]);
+				if (mid != start && mid != end)
+					return mid;
+			}
+		}
+
+		// Otherwise split in half at the median centroid along the widest axis,
+		// which also bounds the depth of the rest of the subtree
+		int dim = centroidBounds.MaximumExtent();
+		int mid = (start + end) / 2;
+		std::nth_element(&bvhLights[start], &bvhLights[mid], &bvhLights[end - 1] + 1,
+			[dim](const BVHLight& a, const BVHLight& b) {
+				return a.centroid[dim] < b.centroid[dim];
+			});
+		return mid;
+	}
+
+	void BVHLightDistribution::BuildSubtree(std::vector<BVHLight>& bvhLights, int start,
+		int end, uint64_t bitTrail, int depth, std::vector<LightBVHNode>* subtreeNodes)
+	{
+		if (end - start == 1)
+		{
+			const BVHLight& light = bvhLights[start];
+			subtreeNodes->push_back({ light.bounds, light.index, true });
+			lightBitTrail[light.index] = bitTrail;
+			return;
+		}
+		int mid = Partition(bvhLights, start, end, depth);
+		int nodeIndex = int(subtreeNodes->size());
+		subtreeNodes->push_back(LightBVHNode());
+		BuildSubtree(bvhLights, start, mid, bitTrail, depth + 1, subtreeNodes);
+		int secondChild = int(subtreeNodes->size());
+		BuildSubtree(bvhLights, mid, end, bitTrail | (uint64_t(1) << depth), depth + 1,
+			subtreeNodes);
+		(*subtreeNodes)[nodeIndex] = { Union((*subtreeNodes)[nodeIndex + 1].bounds,
+			(*subtreeNodes)[secondChild].bounds), secondChild, false };
+	}
+
+	int BVHLightDistribution::Sample(const Point3f& p, const Normal3f& n, float u,
+		float* pmf) const
+	{
+		// Pick either an unbounded light or the hierarchy
+		const float pUnbounded = UnboundedProbability();
+		if (u < pUnbounded)
+		{
+			int nUnbounded = int(unboundedLights.size());
+			int i = std::min(int(u / pUnbounded * nUnbounded), nUnbounded - 1);
+			*pmf = pUnbounded / nUnbounded;
+			return unboundedLights[i];
+		}
+		*pmf = 0;
+		if (nodes.empty())
+			return -1;
+		u = std::min((u - pUnbounded) / (1 - pUnbounded), OneMinusEpsilon);
+
+		// Descend, reusing _u_ for each choice of child
+		int nodeIndex = 0;
+		float nodePMF = 1 - pUnbounded;
+		while (true)
+		{
+			const LightBVHNode& node = nodes[nodeIndex];
+			if (node.isLeaf)
+			{
+				// Below the root, the parent already found the leaf important
+				if (nodeIndex > 0 || node.bounds.Importance(p, n) > 0)
+				{
+					*pmf = nodePMF;
+					return node.childOrLightIndex;
+				}
+				return -1;
+			}
+			float ci[2] = { nodes[nodeIndex + 1].bounds.Importance(p, n),
+				nodes[node.childOrLightIndex].bounds.Importance(p, n) };
+			if (ci[0] == 0 && ci[1] == 0)
+				return -1;
+			float p0 = ci[0] / (ci[0] + ci[1]);
+			if (u < p0)
+			{
+				nodeIndex = nodeIndex + 1;
+				u = std::min(u / p0, OneMinusEpsilon);
+				nodePMF *= p0;
+			}
+			else
+			{
+				nodeIndex = node.childOrLightIndex;
+				u = std::min((u - p0) / (1 - p0), OneMinusEpsilon);
+				nodePMF *= 1 - p0;
+			}
+		}
+	}
+
+	float BVHLightDistribution::PMF(const Point3f& p, const Normal3f& n, int lightIndex) const
+	{
+		const float pUnbounded = UnboundedProbability();
+		if (lightGroup[lightIndex] == LightGroup::None)
+			return 0;
+		if (lightGroup[lightIndex] == LightGroup::Unbounded)
+			return pUnbounded / unboundedLights.size();
+
+		// Follow the light's bit trail down from the root
+		uint64_t bitTrail = lightBitTrail[lightIndex];
+		float pmf = 1 - pUnbounded;
+		int nodeIndex = 0;
+		if (nodes[0].isLeaf)
+			return nodes[0].bounds.Importance(p, n) > 0 ? pmf : 0;
+		while (!nodes[nodeIndex].isLeaf)
+		{
+			const LightBVHNode& node = nodes[nodeIndex];
+			float ci[2] = { nodes[nodeIndex + 1].bounds.Importance(p, n),
+				nodes[node.childOrLightIndex].bounds.Importance(p, n) };
+			int child = int(bitTrail & 1);
+			if (ci[child] == 0)
+				return 0;
+			pmf *= ci[child] / (ci[0] + ci[1]);
+			nodeIndex = child ? node.childOrLightIndex : nodeIndex + 1;
+			bitTrail >>= 1;
+		}
+		return pmf;
+	}
+
+	std::shared_ptr<const LightDistribution> CreateLightSampleDistribution(
+		const std::string& name, const Scene& scene)
+	{
+		if (name == "uniform" || scene.lights.size() == 1)
+			return std::make_shared<UniformLightDistribution>(scene);
+		else if (name == "power")
+			return std::make_shared<PowerLightDistribution>(scene);
+		else if (name == "spatial")
+			return std::make_shared<SpatialLightDistribution>(scene);
+		else if (name == "bvh")
+			return std::make_shared<BVHLightDistribution>(scene.lights);
+		Error("Light sample distribution type \"%s\" unknown. Using \"spatial\".",
+			name.c_str());
+		return std::make_shared<SpatialLightDistribution>(scene);
+	}
+}
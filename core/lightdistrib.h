@@ -0,0 +1,146 @@
+#ifndef PBRT_CORE_LIGHTDISTRIB_H
+#define PBRT_CORE_LIGHTDISTRIB_H
+
+#include "pbrt.h"
+#include "geometry.h"
+#include "light.h"
+#include "sampling.h"
+#include <atomic>
+
+namespace pbrt
+{
+	// Gives the probabilities with which to pick each of the scene's lights
+	// when sampling direct lighting at a point
+	class LightDistribution
+	{
+	public:
+		virtual ~LightDistribution() = default;
+		// Picks a light for a point with surface normal _n_, zero for points
+		// in media, and returns its index in scene.lights; returns -1 if no
+		// light can contribute
+		virtual int Sample(const Point3f& p, const Normal3f& n, float u,
+			float* pmf) const = 0;
+		// Probability that Sample() picks light _lightIndex_
+		virtual float PMF(const Point3f& p, const Normal3f& n, int lightIndex) const = 0;
+	};
+
+	// Distributions that tabulate the probabilities of all lights for each
+	// region of space
+	class TabulatedLightDistribution : public LightDistribution
+	{
+	public:
+		// The returned distribution is indexed like scene.lights and lives
+		// as long as the LightDistribution
+		virtual const Distribution1D* Lookup(const Point3f& p) const = 0;
+		int Sample(const Point3f& p, const Normal3f& n, float u,
+			float* pmf) const override
+		{
+			return Lookup(p)->SampleDiscrete(u, pmf);
+		}
+		float PMF(const Point3f& p, const Normal3f& n, int lightIndex) const override
+		{
+			return Lookup(p)->DiscretePDF(lightIndex);
+		}
+	};
+
+	// Picks each light with equal probability
+	class UniformLightDistribution : public TabulatedLightDistribution
+	{
+	public:
+		explicit UniformLightDistribution(const Scene& scene);
+		const Distribution1D* Lookup(const Point3f& p) const override;
+	private:
+		std::unique_ptr<Distribution1D> distrib;
+	};
+
+	// Picks lights in proportion to their emitted power
+	class PowerLightDistribution : public TabulatedLightDistribution
+	{
+	public:
+		explicit PowerLightDistribution(const Scene& scene);
+		const Distribution1D* Lookup(const Point3f& p) const override;
+	private:
+		std::unique_ptr<Distribution1D> distrib;
+	};
+
+	// Picks lights in proportion to an estimate of their contribution to
+	// the voxel holding the point. The voxels' distributions are computed
+	// on first use and kept in a lock-free hash table, so that regions the
+	// camera never sees cost nothing.
+	class SpatialLightDistribution : public TabulatedLightDistribution
+	{
+	public:
+		SpatialLightDistribution(const Scene& scene, int maxVoxels = 64);
+		~SpatialLightDistribution();
+		const Distribution1D* Lookup(const Point3f& p) const override;
+	private:
+		Distribution1D* ComputeDistribution(const Point3i& pi) const;
+
+		const Scene& scene;
+		int nVoxels[3];
+		struct HashEntry
+		{
+			std::atomic<uint64_t> packedPos;
+			std::atomic<Distribution1D*> distribution;
+		};
+		mutable std::unique_ptr<HashEntry[]> hashTable;
+		size_t hashTableSize;
+	};
+
+	// Picks lights by traversing a hierarchy over their LightBounds, going
+	// down each level with probability proportional to the importance of
+	// the two children at the point, so that picking a light takes time
+	// logarithmic in the number of lights. Lights without bounds are picked
+	// uniformly, with the same probability as the whole hierarchy.
+	class BVHLightDistribution : public LightDistribution
+	{
+	public:
+		explicit BVHLightDistribution(const std::vector<std::shared_ptr<Light>>& lights);
+		int Sample(const Point3f& p, const Normal3f& n, float u,
+			float* pmf) const override;
+		float PMF(const Point3f& p, const Normal3f& n, int lightIndex) const override;
+	private:
+		struct BVHLight
+		{
+			int index;
+			LightBounds bounds;
+			Point3f centroid;
+		};
+		struct LightBVHNode
+		{
+			LightBounds bounds;
+			// Leaves hold the index of their light in scene.lights; interior
+			// nodes the index of their second child, the first following them
+			int childOrLightIndex;
+			bool isLeaf;
+		};
+		int Partition(std::vector<BVHLight>& bvhLights, int start, int end,
+			int depth) const;
+		void BuildSubtree(std::vector<BVHLight>& bvhLights, int start, int end,
+			uint64_t bitTrail, int depth, std::vector<LightBVHNode>* subtreeNodes);
+
+		// Probability of picking one of the unbounded lights
+		float UnboundedProbability() const
+		{
+			if (unboundedLights.empty()) return 0;
+			return float(unboundedLights.size()) /
+				(unboundedLights.size() + (nodes.empty() ? 0 : 1));
+		}
+
+		std::vector<LightBVHNode> nodes;
+		std::vector<int> unboundedLights;
+		// Lights with bounds but no power are never picked
+		enum class LightGroup : uint8_t { None, Hierarchy, Unbounded };
+		std::vector<LightGroup> lightGroup;
+		// Branches taken from the root to each bounded light's leaf, one
+		// bit per level starting with the lowest; 1 means the second child
+		std::vector<uint64_t> lightBitTrail;
+	};
+
+	// Returns the named strategy; "bvh" shares the hierarchy the scene
+	// built when it was constructed
+	std::shared_ptr<const LightDistribution> CreateLightSampleDistribution(
+		const std::string& name, const Scene& scene);
+}
+
+#endif
@@ -1,16 +1,208 @@
 #include "memory.h"
+#include "stats.h"
+#include "parallel.h"
+#if defined(PBRT_IS_WINDOWS)
 #include <malloc.h>
+#else
+#include <stdlib.h>
+#include <sys/mman.h>
+#endif
 
 namespace pbrt
 {
+	// Memory Local Definitions
+	static thread_local MemoryArena* threadArena = nullptr;
+
+	static void ReportPerThreadArenaStats(StatsAccumulator& accum)
+	{
+		if (!threadArena) return;
+		accum.ReportMemoryCounter("Memory/Per-thread arenas",
+		                          threadArena->TotalAllocated());
+		// Summed over threads, the peaks bound how much of the arenas' memory
+		// was ever in use at once
+		accum.ReportMemoryCounter("Memory/Per-thread arena peak use",
+		                          threadArena->HighWaterMark());
+	}
+	static StatRegisterer perThreadArenaStatsReg(ReportPerThreadArenaStats);
+
+	STAT_MEMORY_COUNTER("Memory/Huge page mappings", hugePageBytes);
+
+	// Every allocation is preceded by a header recording how it was made, so
+	// that FreeAligned() can release it the same way.
+	struct alignas(PBRT_L1_CACHE_LINE_SIZE) AllocHeader
+	{
+		void* base;
+		size_t mappedBytes;  // zero unless the block was mmap()ed
+	};
+
+	// Allocations at least this large get their own mapping, aligned to and
+	// backed by transparent huge pages where the OS provides them
+	static constexpr size_t LargeAllocThreshold = 4 << 20;
+	static constexpr size_t HugePageSize = 2 << 20;
+
+#if !defined(PBRT_IS_WINDOWS)
+	static void* MapLarge(size_t size)
+	{
+		// Over-allocate by a huge page so the block can start on a boundary
+		size_t mapBytes = (size + sizeof(AllocHeader) + 2 * HugePageSize - 1) &
+		                  ~(HugePageSize - 1);
+		void* mem = mmap(nullptr, mapBytes, PROT_READ | PROT_WRITE,
+		                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) return nullptr;
+		uint8_t* start = (uint8_t*)(((uintptr_t)mem + HugePageSize - 1) &
+		                            ~(uintptr_t)(HugePageSize - 1));
+		// Return the unaligned head and tail to the OS
+		size_t head = start - (uint8_t*)mem;
+		size_t keep = mapBytes - HugePageSize;
+		if (head > 0) munmap(mem, head);
+		if (mapBytes - head > keep) munmap(start + keep, mapBytes - head - keep);
+#ifdef MADV_HUGEPAGE
+		madvise(start, keep, MADV_HUGEPAGE);
+#endif
+		// Prefault only after the advice, so that the faults bring in huge
+		// pages rather than 4K ones
+		if (PbrtOptions.prefaultMemory)
+		{
+			bool populated = false;
+#ifdef MADV_POPULATE_WRITE
+			populated = madvise(start, keep, MADV_POPULATE_WRITE) == 0;
+#endif
+			// Older kernels: write one byte per huge page
+			if (!populated)
+				for (size_t offset = 0; offset < keep; offset += HugePageSize)
+					((volatile uint8_t*)start)[offset] = 0;
+		}
+		hugePageBytes += keep;
+		AllocHeader* header = (AllocHeader*)start;
+		header->base = start;
+		header->mappedBytes = keep;
+		return header + 1;
+	}
+#endif
+
 	void* AllocAligned(size_t size)
 	{
-		return _aligned_malloc(size, PBRT_L1_CACHE_LINE_SIZE);
+#if !defined(PBRT_IS_WINDOWS)
+		if (size >= LargeAllocThreshold)
+			if (void* ptr = MapLarge(size)) return ptr;
+#endif
+		void* base;
+#if defined(PBRT_IS_WINDOWS)
+		base = _aligned_malloc(size + sizeof(AllocHeader), PBRT_L1_CACHE_LINE_SIZE);
+#else
+		if (posix_memalign(&base, PBRT_L1_CACHE_LINE_SIZE, size + sizeof(AllocHeader)) != 0)
+			base = nullptr;
+#endif
+		if (!base) return nullptr;
+		AllocHeader* header = (AllocHeader*)base;
+		header->base = base;
+		header->mappedBytes = 0;
+		return header + 1;
 	}
 
 	void FreeAligned(void* ptr)
 	{
 		if (!ptr) return;
-		_aligned_free(ptr);
+		AllocHeader* header = (AllocHeader*)ptr - 1;
+#if defined(PBRT_IS_WINDOWS)
+		_aligned_free(header->base);
+#else
+		if (header->mappedBytes > 0)
+			munmap(header->base, header->mappedBytes);
+		else
+			free(header->base);
+#endif
+	}
+
+	MemoryArena& PerThreadArena()
+	{
+		thread_local MemoryArena arena;
+		threadArena = &arena;
+		return arena;
+	}
+
+	// ConcurrentMemoryArena Method Definitions
+	ConcurrentMemoryArena::ConcurrentMemoryArena(size_t blockSize, size_t chunkSize)
+		: blockSize(blockSize), chunkSize(chunkSize), nChunks(MaxThreadIndex()),
+		  chunks(new ThreadChunk[nChunks])
+	{
+	}
+
+	ConcurrentMemoryArena::~ConcurrentMemoryArena()
+	{
+		for (Block* list : { currentBlock.load(), largeBlocks.load() })
+			while (list)
+			{
+				Block* next = list->next;
+				list->~Block();
+				FreeAligned(list);
+				list = next;
+			}
+	}
+
+	void* ConcurrentMemoryArena::Alloc(size_t nBytes)
+	{
+		// Round up _nBytes_ to minimum machine alignment
+		nBytes = (nBytes + 16 - 1) & ~(16 - 1);
+		// Threads outside the pool, and requests too large to share a chunk,
+		// go straight to the shared blocks
+		if (ThreadIndex < 0 || ThreadIndex >= nChunks || nBytes > chunkSize / 4)
+			return Carve(nBytes);
+		ThreadChunk& chunk = chunks[ThreadIndex];
+		if (chunk.pos + nBytes > chunk.end)
+		{
+			chunk.pos = Carve(chunkSize);
+			chunk.end = chunk.pos + chunkSize;
+		}
+		void* ret = chunk.pos;
+		chunk.pos += nBytes;
+		return ret;
+	}
+
+	size_t ConcurrentMemoryArena::TotalAllocated() const
+	{
+		size_t total = 0;
+		for (Block* list : { currentBlock.load(), largeBlocks.load() })
+			for (; list; list = list->next) total += list->size;
+		return total;
+	}
+
+	uint8_t* ConcurrentMemoryArena::Carve(size_t nBytes)
+	{
+		if (nBytes > blockSize / 4)
+		{
+			// Give large requests a block of their own
+			Block* block = NewBlock(nBytes, nBytes, largeBlocks.load());
+			while (!largeBlocks.compare_exchange_weak(block->next, block))
+				;
+			return block->Data();
+		}
+		while (true)
+		{
+			Block* block = currentBlock.load();
+			if (block)
+			{
+				size_t offset = block->offset.fetch_add(nBytes);
+				if (offset + nBytes <= block->size) return block->Data() + offset;
+			}
+			// Install a new block with our request already reserved; if
+			// another thread got there first, use its block instead
+			Block* newBlock = NewBlock(blockSize, nBytes, block);
+			if (currentBlock.compare_exchange_strong(block, newBlock))
+				return newBlock->Data();
+			newBlock->~Block();
+			FreeAligned(newBlock);
+		}
+	}
+
+	ConcurrentMemoryArena::Block* ConcurrentMemoryArena::NewBlock(
+		size_t size, size_t reserved, Block* next) const
+	{
+		void* mem = AllocAligned(sizeof(Block) + size);
+		Block* block = new (mem) Block;
+		block->next = next;
+		block->size = size;
+		block->offset = reserved;
+		return block;
 	}
 }
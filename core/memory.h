@@ -2,7 +2,8 @@
 #define PBRT_CORE_MEMORY_H
 
 #include "pbrt.h"
-#include <list>
+#include <vector>
+#include <atomic>
 
 namespace pbrt
 {
@@ -67,6 +68,7 @@ namespace pbrt
 			}
 			void* ret = currentBlockStartPos + currentBlockPos;
 			currentBlockPos += nBytes;
+			bytesInUse += nBytes;
 			return ret;
 		}
 
@@ -81,8 +83,12 @@ namespace pbrt
 
 		void Reset()
 		{
+			highWaterMark = std::max(highWaterMark, bytesInUse);
 			currentBlockPos = 0;
-			availableBlocks.splice(availableBlocks.begin(), usedBlocks);
+			bytesInUse = 0;
+			availableBlocks.insert(availableBlocks.end(), usedBlocks.begin(),
+			                       usedBlocks.end());
+			usedBlocks.clear();
 		}
 
 		size_t TotalAllocated() const
@@ -93,14 +99,76 @@ namespace pbrt
 			return total;
 		}
 
+		// Largest number of bytes handed out between two calls to Reset()
+		size_t HighWaterMark() const
+		{
+			return std::max(highWaterMark, bytesInUse);
+		}
+
 	private:
 		MemoryArena(const MemoryArena&) = delete;
 		MemoryArena& operator=(const MemoryArena&) = delete;
 		// MemoryArena Private Data
 		const size_t blockSize;
 		size_t currentBlockPos = 0, currentAllocSize = 0;
+		size_t bytesInUse = 0, highWaterMark = 0;
 		uint8_t* currentBlockStartPos = nullptr;
-		std::list<std::pair<size_t, uint8_t*>> usedBlocks, availableBlocks;
+		std::vector<std::pair<size_t, uint8_t*>> usedBlocks, availableBlocks;
+	};
+
+	// Returns the calling thread's arena. It lives as long as the thread, so
+	// its blocks are reused across tiles and across ParallelFor() calls;
+	// callers must Reset() it when they are done.
+	MemoryArena& PerThreadArena();
+
+	// Arena that may be used by all threads of the pool at once. Each thread
+	// bump-allocates from its own chunk; chunks are carved from shared
+	// blocks with atomic operations only, so allocation never takes a lock.
+	// Memory is released when the arena is destroyed.
+	class ConcurrentMemoryArena
+	{
+	public:
+		// ConcurrentMemoryArena Public Methods
+		ConcurrentMemoryArena(size_t blockSize = 1 << 20, size_t chunkSize = 16384);
+		~ConcurrentMemoryArena();
+		void* Alloc(size_t nBytes);
+
+		template <typename T>
+		T* Alloc(size_t n = 1, bool runConstructor = true)
+		{
+			T* ret = (T*)Alloc(n * sizeof(T));
+			if (runConstructor)
+				for (size_t i = 0; i < n; ++i) new(&ret[i]) T();
+			return ret;
+		}
+
+		size_t TotalAllocated() const;
+
+	private:
+		ConcurrentMemoryArena(const ConcurrentMemoryArena&) = delete;
+		ConcurrentMemoryArena& operator=(const ConcurrentMemoryArena&) = delete;
+		// ConcurrentMemoryArena Private Declarations
+		struct alignas(PBRT_L1_CACHE_LINE_SIZE) Block
+		{
+			Block* next;
+			size_t size;
+			std::atomic<size_t> offset;
+			uint8_t* Data() { return reinterpret_cast<uint8_t*>(this + 1); }
+		};
+		struct alignas(PBRT_L1_CACHE_LINE_SIZE) ThreadChunk
+		{
+			uint8_t* pos = nullptr;
+			uint8_t* end = nullptr;
+		};
+		// ConcurrentMemoryArena Private Methods
+		uint8_t* Carve(size_t nBytes);
+		Block* NewBlock(size_t size, size_t reserved, Block* next) const;
+		// ConcurrentMemoryArena Private Data
+		const size_t blockSize, chunkSize;
+		std::atomic<Block*> currentBlock{ nullptr };
+		std::atomic<Block*> largeBlocks{ nullptr };
+		const int nChunks;
+		std::unique_ptr<ThreadChunk[]> chunks;
 	};
 
     template <typename T, int logBlockSize>
@@ -75,6 +75,15 @@ namespace pbrt {
 
     static std::condition_variable workListCondition;
 
+    // Removes _loop_ from _workList_ once its last chunk has been handed out.
+    // Several threads may be running loops of their own, so _loop_ need not
+    // be at the head of the list.
+    static void UnlinkLoop(ParallelForLoop* loop) {
+        ParallelForLoop** p = &workList;
+        while (*p && *p != loop) p = &(*p)->next;
+        if (*p) *p = loop->next;
+    }
+
     static void workerThreadFunc(int tIndex, std::shared_ptr<Barrier> barrier) {
         //LOG(INFO) << "Started execution in worker thread " << tIndex;
         ThreadIndex = tIndex;
@@ -120,7 +129,7 @@ namespace pbrt {
 
                 // Update _loop_ to reflect iterations this thread will run
                 loop.nextIndex = indexEnd;
-                if (loop.nextIndex == loop.maxIndex) workList = loop.next;
+                if (loop.nextIndex == loop.maxIndex) UnlinkLoop(&loop);
                 loop.activeWorkers++;
 
                 // Run loop indices in _[indexStart, indexEnd)_
@@ -173,6 +182,13 @@ namespace pbrt {
 
         // Help out with parallel loop iterations in the current thread
         while (!loop.Finished()) {
+            // Wait for workers still running the last chunks; they notify
+            // once the loop is finished
+            if (loop.nextIndex == loop.maxIndex) {
+                workListCondition.wait(lock);
+                continue;
+            }
+
             // Run a chunk of loop iterations for _loop_
 
             // Find the set of loop iterations to run next
@@ -181,7 +197,7 @@ namespace pbrt {
 
             // Update _loop_ to reflect iterations this thread will run
             loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
+            if (loop.nextIndex == loop.maxIndex) UnlinkLoop(&loop);
             loop.activeWorkers++;
 
             // Run loop indices in _[indexStart, indexEnd)_
@@ -206,7 +222,8 @@ namespace pbrt {
         }
     }
 
-    thread_local int ThreadIndex;
+    // Threads that are not part of the pool keep an index of -1
+    thread_local int ThreadIndex = -1;
 
     int MaxThreadIndex() {
         return PbrtOptions.nThreads == 0 ? NumSystemCores() : PbrtOptions.nThreads;
@@ -233,6 +250,13 @@ namespace pbrt {
 
         // Help out with parallel loop iterations in the current thread
         while (!loop.Finished()) {
+            // Wait for workers still running the last chunks; they notify
+            // once the loop is finished
+            if (loop.nextIndex == loop.maxIndex) {
+                workListCondition.wait(lock);
+                continue;
+            }
+
             // Run a chunk of loop iterations for _loop_
 
             // Find the set of loop iterations to run next
@@ -241,7 +265,7 @@ namespace pbrt {
 
             // Update _loop_ to reflect iterations this thread will run
             loop.nextIndex = indexEnd;
-            if (loop.nextIndex == loop.maxIndex) workList = loop.next;
+            if (loop.nextIndex == loop.maxIndex) UnlinkLoop(&loop);
             loop.activeWorkers++;
 
             // Run loop indices in _[indexStart, indexEnd)_
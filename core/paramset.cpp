@@ -143,6 +143,11 @@ namespace pbrt
         LOOKUP_PTR(spectra);
     }
 
+    const std::string *ParamSet::FindString(const std::string& name, int *nValues) const
+    {
+        LOOKUP_PTR(strings);
+    }
+
     void ParamSet::ReportUnused() const
     {
         // TODO implement
@@ -165,6 +170,23 @@ namespace pbrt
         return false;
     }
 
+    void ParamSet::AddBool(const std::string &name, std::unique_ptr<bool[]> values, int nValues)
+    {
+        EraseBool(name);
+        ADD_PARAM_TYPE(bool, bools);
+    }
+
+    bool ParamSet::EraseBool(const std::string & n)
+    {
+        for (size_t i = 0; i < bools.size(); ++i)
+            if (bools[i]->name == n)
+            {
+                bools.erase(bools.begin() + i);
+                return true;
+            }
+        return false;
+    }
+
     void ParamSet::AddFloat(const std::string &name, std::unique_ptr<float[]> values, int nValues)
     {
         EraseFloat(name);
@@ -404,6 +404,27 @@ namespace pbrt
                     fdata[j] = static_cast<float>(item.doubleValues[j]);
                 ps.AddFloat(name, std::move(fdata), nItems);
             }
+            else if (type == PARAM_TYPE_BOOL)
+            {
+                std::unique_ptr<bool[]> bdata(new bool[nItems]);
+                for (int j = 0; j < nItems; ++j)
+                {
+                    std::string s(item.stringValues[j]);
+                    if (s == "true")
+                        bdata[j] = true;
+                    else if (s == "false")
+                        bdata[j] = false;
+                    else
+                    {
+                        Warning(
+                            "Value \"%s\" unknown for Boolean parameter \"%s\". "
+                            "Using \"false\".",
+                            s.c_str(), item.name.c_str());
+                        bdata[j] = false;
+                    }
+                }
+                ps.AddBool(name, std::move(bdata), nItems);
+            }
             else if (type == PARAM_TYPE_POINT3)
             {
                 if ((nItems % 3) != 0)
@@ -470,7 +491,7 @@ namespace pbrt
                         name.c_str());
             }
             else
-                Warning("Type of parameter {} is unknown", item.name.c_str());
+                Warning("Type of parameter \"%s\" is unknown", item.name.c_str());
         }
     }
 
@@ -55,6 +55,24 @@ namespace pbrt
 		int nThreads = 0;
 		bool quickRender = false;
 		bool quiet = false, verbose = false;
+		// Pre-fault large allocations (MAP_POPULATE) instead of on first touch
+		bool prefaultMemory = false;
+		// Produce bit-identical images regardless of thread count and timing
+		bool deterministic = false;
+		// Seconds between progressive image writes; 0 disables them
+		float writeInterval = 0;
+		// Relative error at which adaptive sampling stops sampling a pixel;
+		// 0 gives every pixel the sampler's full sample count
+		float adaptiveThreshold = 0;
+		// Seconds of wall-clock time to render for, at most the sampler's
+		// sample count per pixel; 0 takes all samples
+		float timeBudget = 0;
+		// Write the image after every pass of a progressive render
+		bool writePasses = false;
+		// Seconds between render checkpoints; 0 disables them
+		float checkpointInterval = 0;
+		// Continue from the checkpoint of an interrupted render
+		bool resume = false;
 		std::string imageFile;
 		// x0, x1, y0, y1
 		float cropWindow[2][2];
@@ -74,9 +92,11 @@ namespace pbrt
 	class Sampler;
 	class Camera;
 	struct CameraSample;
+	struct AOVSample;
 	class Film;
 	class FilmTile;
 	class MemoryArena;
+	class ConcurrentMemoryArena;
 	class RGBSpectrum;
 	class SampledSpectrum;
 #ifdef PBRT_SAMPLED_SPECTRUM
@@ -87,6 +107,7 @@ namespace pbrt
 	class Primitive;
 	class Light;
 	class AreaLight;
+	class LightDistribution;
 	class Material;
 	class VisibilityTester;
 	struct Interaction;
@@ -261,6 +282,47 @@ namespace pbrt
 		return f;
 	}
 
+	// IEEE 754 binary16 conversion, rounding to nearest even
+	inline uint16_t FloatToHalf(float f)
+	{
+		uint32_t ui = FloatToBits(f);
+		uint16_t sign = (ui >> 16) & 0x8000;
+		ui &= 0x7fffffff;
+		// Handle NaN, overflow and underflow
+		if (ui >= 0x47800000)
+			return sign | (ui > 0x7f800000 ? 0x7e00 : 0x7c00);
+		if (ui < 0x33000000)
+			return sign;
+		if (ui < 0x38800000)
+		{
+			// Round to a denormalized half
+			uint32_t mant = (ui & 0x7fffff) | 0x800000;
+			int shift = 126 - int(ui >> 23);
+			uint32_t h = mant >> shift, rem = mant & ((1u << shift) - 1);
+			uint32_t halfway = 1u << (shift - 1);
+			if (rem > halfway || (rem == halfway && (h & 1)))
+				++h;
+			return sign | uint16_t(h);
+		}
+		// Rebias the exponent; rounding may carry into it, up to infinity
+		ui += 0xc8000000;
+		return sign | uint16_t((ui + 0xfff + ((ui >> 13) & 1)) >> 13);
+	}
+
+	inline float HalfToFloat(uint16_t h)
+	{
+		uint32_t sign = uint32_t(h & 0x8000) << 16;
+		uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+		if (exp == 0x1f)
+			return BitsToFloat(sign | 0x7f800000 | (mant << 13));
+		if (exp == 0)
+		{
+			float f = mant * (1.f / 16777216.f);
+			return sign ? -f : f;
+		}
+		return BitsToFloat(sign | ((exp + 112) << 23) | (mant << 13));
+	}
+
 	inline float NextFloatUp(float v)
 	{
 		// Handle infinity and negative zero for _NextFloatUp()_
@@ -4,11 +4,13 @@
 
 namespace pbrt
 {
+	std::atomic<int> GeometricPrimitive::nextId(0);
+
 	GeometricPrimitive::GeometricPrimitive(const std::shared_ptr<Shape>& shape,
 	                                       const std::shared_ptr<Material>& material,
 	                                       const std::shared_ptr<AreaLight>& areaLight,
 	                                       const MediumInterface& mediumInterface)
-		: shape(shape), material(material), areaLight(areaLight),
+		: id(nextId++), shape(shape), material(material), areaLight(areaLight),
 		  mediumInterface(mediumInterface){}
 
 	Bounds3f GeometricPrimitive::WorldBound() const
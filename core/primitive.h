@@ -5,6 +5,7 @@
 #include "geometry.h"
 #include "material.h"
 #include "interaction.h"
+#include <atomic>
 
 namespace pbrt
 {
@@ -19,6 +20,8 @@ namespace pbrt
 		virtual const Material* GetMaterial() const = 0;
 		virtual void ComputeScatteringFunctions(SurfaceInteraction* isect,
 			MemoryArena& arena, TransportMode mode, bool allowMultipleLobes) const = 0;
+		// Identifier written to the primitive ID AOV; -1 if there is none
+		virtual int GetPrimitiveId() const { return -1; }
 		BSDF* bsdf = nullptr;
 		BSSRDF* bssrdf = nullptr;
 	};
@@ -36,7 +39,11 @@ namespace pbrt
 		const AreaLight* GetAreaLight() const override;
 		const Material* GetMaterial() const override;
 	void ComputeScatteringFunctions(SurfaceInteraction* isect, MemoryArena& arena, TransportMode mode, bool allowMultipleLobes) const override;
+		int GetPrimitiveId() const override { return id; }
 	private:
+		// Primitives are numbered in creation order, which follows the scene file
+		static std::atomic<int> nextId;
+		const int id;
 		std::shared_ptr<Shape> shape;
 		std::shared_ptr<Material> material;
 		std::shared_ptr<AreaLight> areaLight;
@@ -314,8 +314,8 @@ namespace pbrt
 		Spectrum f(0.f);
 		for (int i = 0; i < nBxDFs; ++i)
 			if (bxdfs[i]->MatchesFlags(flags) &&
-				(reflect && (bxdfs[i]->type && BSDF_REFLECTION)) ||
-				(!reflect && (bxdfs[i]->type && BSDF_TRANSMISSION)))
+				((reflect && (bxdfs[i]->type & BSDF_REFLECTION)) ||
+				(!reflect && (bxdfs[i]->type & BSDF_TRANSMISSION))))
 				f += bxdfs[i]->f(wo, wi);
 		return f;
 	}
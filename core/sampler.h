@@ -16,15 +16,28 @@ namespace pbrt
 		virtual std::unique_ptr<Sampler> Clone(int seed) = 0;
 		virtual void StartPixel(const Point2i& p);
 		virtual bool StartNextSample();
-		CameraSample GetCameraSample(const Point2i& pRaster)
+		CameraSample GetCameraSample(const Point2i& pRaster,
+			const FilterSampler* filterSampler = nullptr)
 		{
 			CameraSample cs;
-			cs.pFilm = static_cast<Point2f>(pRaster) + Get2D();
+			if (filterSampler)
+			{
+				// Warp the offset from the pixel center by the filter
+				FilterSample fs = filterSampler->Sample(Get2D());
+				cs.pFilm = static_cast<Point2f>(pRaster) +
+					Vector2f(0.5f + fs.p.x, 0.5f + fs.p.y);
+				cs.filterWeight = fs.weight;
+			}
+			else
+				cs.pFilm = static_cast<Point2f>(pRaster) + Get2D();
 			cs.time = Get1D();
 			cs.pLens = Get2D();
 			return cs;
 		}
 		virtual bool SetSampleNumber(int64_t sampleNum);
+		// Restarts the sampler's random stream, so that the samples of the
+		// next pixel do not depend on the pixels started before it
+		virtual void Reseed(uint64_t seed) {}
 		virtual float Get1D() = 0;
 		virtual Point2f Get2D() = 0;
 		void Request1DArray(int n);
@@ -35,6 +48,10 @@ namespace pbrt
 		{
 			return n;
 		}
+		const Point2i& CurrentPixel() const
+		{
+			return currentPixel;
+		}
 		const int64_t samplesPerPixel;
 	protected:
 		Point2i currentPixel;
@@ -71,6 +88,8 @@ namespace pbrt
 			return Sampler::SetSampleNumber(sampleNum);
 		}
 
+		void Reseed(uint64_t seed) override { rng.SetSequence(seed); }
+
 		float Get1D() override
 		{
 			if (current1DDimension < samples1D.size())
@@ -30,7 +30,7 @@ namespace pbrt
 		float SampleContinuous(float u, float* pdf, int* off = nullptr) const
 		{
 			int offset = FindInterval(cdf.size(),
-				[&](int index) { return cdf[index <= u]; });
+				[&](int index) { return cdf[index] <= u; });
 			if (off) *off = offset;
 			float du = u - cdf[offset];
 			if ((cdf[offset + 1] - cdf[offset]) > 0)
@@ -41,7 +41,7 @@ namespace pbrt
 		int SampleDiscrete(float u, float* pdf = nullptr, float* uRemapped = nullptr) const
 		{
 			int offset = FindInterval(cdf.size(),
-				[&](int index) { return cdf[index <= u]; });
+				[&](int index) { return cdf[index] <= u; });
 			if (pdf) *pdf = func[offset] / (funcInt * Count());
 			if (uRemapped)
 				*uRemapped = (u - cdf[offset]) / (cdf[offset + 1] - cdf[offset]);
@@ -72,7 +72,7 @@ namespace pbrt
 		{
 			float pdfs[2];
 			int v;
-			float d1 = pMarginal->SampleContinuous(u[1], &pdf[1], &v);
+			float d1 = pMarginal->SampleContinuous(u[1], &pdfs[1], &v);
 			float d0 = pConditionalV[v]->SampleContinuous(u[0], &pdfs[0]);
 			*pdf = pdfs[0] * pdfs[1];
 			return Point2f(d0, d1);
@@ -133,6 +133,8 @@ namespace pbrt
 		return Vector3f(d.x, d.y, z);
 	}
 
+	inline float CosineHemispherePdf(float cosTheta) { return cosTheta * InvPi; }
+
 	inline float UniformConePdf(float cosThetaMax)
 	{
 		return 1 / (2 * Pi * (1 - cosThetaMax));
@@ -23,6 +23,8 @@ namespace pbrt
 		virtual Interaction Sample(const Interaction& ref, const Point2f& u) const { return Sample(u); }
 		virtual float Pdf(const Interaction&) const { return 1 / Area(); }
 		virtual float Pdf(const Interaction& ref, const Vector3f& wi) const;
+		// Cone holding the shape's surface normals, in world space
+		virtual DirectionCone NormalBounds() const { return DirectionCone::EntireSphere(); }
 		const Transform* ObjectToWorld;
 		const Transform* WorldToObject;
 		const bool reverseOrientation;
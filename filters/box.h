@@ -10,6 +10,7 @@ namespace pbrt
 	public:
 		BoxFilter(const Vector2f& radius) : Filter(radius) {}
 		float Evaluate(const Point2f& p) const override;
+		bool IsSeparable() const override { return true; }
 	};
 
 	BoxFilter* CreateBoxFilter(const ParamSet& ps);
@@ -10,6 +10,7 @@ namespace pbrt
 	public:
 		GaussianFilter(const Vector2f& radius, float alpha);
 		float Evaluate(const Point2f& p) const override;
+		bool IsSeparable() const override { return true; }
 	private:
 		float Gaussian(float d, float expv) const
 		{
@@ -11,6 +11,7 @@ namespace pbrt
 		MitchellFilter(const Vector2f& radius, float B, float C)
 			: Filter(radius), B(B), C(C) {}
 		float Evaluate(const Point2f& p) const override;
+		bool IsSeparable() const override { return true; }
 		float Mitchell1D(float x) const {
 			x = std::abs(2 * x);
 			if (x > 1)
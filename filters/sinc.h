@@ -13,6 +13,7 @@ namespace pbrt {
         LanczosSincFilter(const Vector2f& radius, float tau)
             : Filter(radius), tau(tau) {}
         float Evaluate(const Point2f& p) const;
+        bool IsSeparable() const override { return true; }
         float Sinc(float x) const {
             x = std::abs(x);
             if (x < 1e-5) return 1;
@@ -10,6 +10,7 @@ namespace pbrt
 	public:
 		TriangleFilter(const Vector2f& radius);
 		float Evaluate(const Point2f& p) const override;
+		bool IsSeparable() const override { return true; }
 	};
 
 	TriangleFilter* CreateTriangleFilter(const ParamSet& ps);
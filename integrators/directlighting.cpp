@@ -24,7 +24,7 @@ namespace pbrt
 				}
 		}
     }
-	Spectrum DirectLightingIntegrator::Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const
+	Spectrum DirectLightingIntegrator::Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth, AOVSample* aov) const
 	{
 		Spectrum L(0.f);
 		SurfaceInteraction isect;
@@ -36,7 +36,8 @@ namespace pbrt
 		}
 
 		isect.ComputeScatteringFunctions(ray, arena);
-		if (!isect.bsdf) return Li(isect.SpawnRay(ray.d), scene, sampler, arena, depth);
+		if (!isect.bsdf) return Li(isect.SpawnRay(ray.d), scene, sampler, arena, depth, aov);
+		RecordAOVSample(aov, ray.o, isect);
 		Vector3f wo = isect.wo;
 
 		L += isect.Le(wo);
@@ -16,7 +16,7 @@ namespace pbrt
 			std::shared_ptr<const Camera> camera,
 			std::shared_ptr<Sampler> sampler);
 		void Preprocess(const Scene& scene, Sampler& sampler) override;
-		Spectrum Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const override;
+		Spectrum Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth, AOVSample* aov) const override;
 	private:
 		const LightStrategy strategy;
 		const int maxDepth;
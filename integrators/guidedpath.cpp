@@ -0,0 +1,500 @@
+#include "guidedpath.h"
+
+#include "core/camera.h"
+#include "core/film.h"
+#include "core/interaction.h"
+#include "core/memory.h"
+#include "core/parallel.h"
+#include "core/paramset.h"
+#include "core/reflection.h"
+#include "core/rng.h"
+#include "core/sampler.h"
+#include "core/scene.h"
+#include "core/stats.h"
+
+namespace pbrt
+{
+	STAT_COUNTER("Integrator/Guiding training passes", nTrainingPasses);
+	STAT_COUNTER("Integrator/Guiding spatial leaves", nSpatialLeaves);
+
+	// Directions map to the unit square by cos(theta) and phi, which
+	// preserves area, so a density on the square is 4*Pi times the
+	// density over solid angle
+	static Point2f DirectionToSquare(const Vector3f& w)
+	{
+		float cosTheta = Clamp(w.z, -1, 1);
+		float phi = std::atan2(w.y, w.x);
+		if (phi < 0)
+			phi += 2 * Pi;
+		return Point2f(Clamp((cosTheta + 1) / 2, 0, OneMinusEpsilon),
+			Clamp(phi * Inv2Pi, 0, OneMinusEpsilon));
+	}
+
+	static Vector3f SquareToDirection(const Point2f& p)
+	{
+		float cosTheta = 2 * p.x - 1;
+		float sinTheta = std::sqrt(std::max(0.f, 1 - cosTheta * cosTheta));
+		float phi = 2 * Pi * p.y;
+		return Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+	}
+
+	// Quadtree over the square of directions. Each node holds the radiance
+	// recorded in its four quadrants and their child nodes; quadrant i
+	// covers the right half if (i & 1) and the upper half if (i & 2).
+	class DTree
+	{
+	public:
+		DTree() : nodes(1) { }
+		DTree(const DTree& other) : nSamples(other.nSamples.load()), nodes(other.nodes) { }
+		DTree& operator=(const DTree& other)
+		{
+			nodes = other.nodes;
+			nSamples = other.nSamples.load();
+			return *this;
+		}
+
+		float Total() const
+		{
+			const Node& root = nodes[0];
+			return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+		}
+
+		// Picks a direction in proportion to the recorded radiance; nodes
+		// without any are sampled uniformly
+		Vector3f Sample(Point2f u) const
+		{
+			Point2f origin(0, 0);
+			float size = 1;
+			int node = 0;
+			while (true)
+			{
+				const Node& n = nodes[node];
+				float s[4] = { n.sum[0], n.sum[1], n.sum[2], n.sum[3] };
+				float total = s[0] + s[1] + s[2] + s[3];
+				if (!(total > 0))
+					break;
+				// Pick the column, then the quadrant within it, remapping
+				// each sample dimension for the levels below
+				int i = 0;
+				float fx = (s[0] + s[2]) / total;
+				if (u.x < fx)
+					u.x /= fx;
+				else
+				{
+					u.x = (u.x - fx) / (1 - fx);
+					i |= 1;
+				}
+				float column = s[i] + s[i + 2];
+				float fy = column > 0 ? s[i] / column : .5f;
+				if (u.y < fy)
+					u.y /= fy;
+				else
+				{
+					u.y = (u.y - fy) / (1 - fy);
+					i |= 2;
+				}
+				size /= 2;
+				origin += Vector2f((i & 1) * size, (i >> 1) * size);
+				if (n.child[i] == 0)
+					break;
+				node = n.child[i];
+			}
+			Point2f p = origin + Vector2f(std::min(u.x, OneMinusEpsilon),
+				std::min(u.y, OneMinusEpsilon)) * size;
+			return SquareToDirection(p);
+		}
+
+		// Density over solid angle with which Sample() returns _w_
+		float Pdf(const Vector3f& w) const
+		{
+			Point2f p = DirectionToSquare(w);
+			float pdf = 1;
+			int node = 0;
+			while (true)
+			{
+				const Node& n = nodes[node];
+				float total = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+				if (!(total > 0))
+					break;
+				int i = Quadrant(&p);
+				pdf *= 4 * n.sum[i] / total;
+				if (n.child[i] == 0 || pdf == 0)
+					break;
+				node = n.child[i];
+			}
+			return pdf * Inv4Pi;
+		}
+
+		// Adds _value_ to every node on the way to _w_'s leaf, so that each
+		// node holds the total of its subtree
+		void Record(const Vector3f& w, float value)
+		{
+			Point2f p = DirectionToSquare(w);
+			int node = 0;
+			while (true)
+			{
+				Node& n = nodes[node];
+				int i = Quadrant(&p);
+				n.sum[i].Add(value);
+				if (n.child[i] == 0)
+					break;
+				node = n.child[i];
+			}
+			++nSamples;
+		}
+
+		// Rebuilds this tree's structure from the radiance in _from_:
+		// quadrants holding more than _fluxThreshold_ of the total are
+		// subdivided and the others merged. The sums start over at zero.
+		void Refine(const DTree& from, float fluxThreshold)
+		{
+			const float total = from.Total();
+			nSamples = 0;
+			if (!(total > 0))
+			{
+				// Nothing recorded; keep the structure
+				nodes = from.nodes;
+				for (Node& n : nodes)
+					for (AtomicFloat& s : n.sum)
+						s = 0;
+				return;
+			}
+			const int maxDepth = 20;
+			// Quadrants that are leaves of _from_ spread their radiance
+			// evenly over any children they get
+			struct Item { int node, fromNode; float sum; int depth; };
+			nodes.assign(1, Node());
+			std::vector<Item> stack = { { 0, 0, total, 1 } };
+			while (!stack.empty())
+			{
+				Item item = stack.back();
+				stack.pop_back();
+				for (int i = 0; i < 4; ++i)
+				{
+					float s = item.sum / 4;
+					int fromChild = -1;
+					if (item.fromNode >= 0)
+					{
+						const Node& f = from.nodes[item.fromNode];
+						s = f.sum[i];
+						if (f.child[i] != 0)
+							fromChild = f.child[i];
+					}
+					if (item.depth < maxDepth && s > fluxThreshold * total)
+					{
+						int child = int(nodes.size());
+						nodes.emplace_back();
+						nodes[item.node].child[i] = child;
+						stack.push_back({ child, fromChild, s, item.depth + 1 });
+					}
+				}
+			}
+		}
+
+		// Number of Record() calls since the last Refine()
+		std::atomic<uint64_t> nSamples{ 0 };
+	private:
+		struct Node
+		{
+			AtomicFloat sum[4];
+			// Index of each quadrant's node, zero for leaves
+			int child[4] = { 0, 0, 0, 0 };
+			Node() = default;
+			Node(const Node& n) { *this = n; }
+			Node& operator=(const Node& n)
+			{
+				for (int i = 0; i < 4; ++i)
+				{
+					sum[i] = float(n.sum[i]);
+					child[i] = n.child[i];
+				}
+				return *this;
+			}
+		};
+
+		// Returns the quadrant holding _p_ and maps _p_ into it
+		static int Quadrant(Point2f* p)
+		{
+			int i = 0;
+			for (int c = 0; c < 2; ++c)
+			{
+				(*p)[c] *= 2;
+				if ((*p)[c] >= 1)
+				{
+					(*p)[c] = std::min((*p)[c] - 1, OneMinusEpsilon);
+					i |= 1 << c;
+				}
+			}
+			return i;
+		}
+
+		std::vector<Node> nodes;
+	};
+
+	// Directional trees of one region of space: render passes sample
+	// _sampling_ and training passes record into _building_
+	struct DTreePair
+	{
+		DTree sampling, building;
+	};
+
+	// Binary tree over the scene's bounding cube, splitting at the middle
+	// along x, y and z in turn
+	struct SDTree
+	{
+		explicit SDTree(const Bounds3f& sceneBounds)
+			: nodes(1)
+		{
+			// A cube keeps the regions' aspect ratio bounded
+			Vector3f d = sceneBounds.Diagonal();
+			float extent = std::max({ d.x, d.y, d.z }) * 1.001f;
+			Point3f pMin = sceneBounds.pMin - Vector3f(extent - d.x, extent - d.y, extent - d.z) / 2;
+			bounds = Bounds3f(pMin, pMin + Vector3f(extent, extent, extent));
+			nodes[0].trees.reset(new DTreePair());
+		}
+
+		DTreePair* Lookup(const Point3f& p) const
+		{
+			Vector3f o = bounds.Offset(p);
+			int node = 0;
+			while (nodes[node].child != 0)
+			{
+				const Node& n = nodes[node];
+				float c = Clamp(o[n.axis], 0, OneMinusEpsilon) * 2;
+				if (c < 1)
+					node = n.child;
+				else
+				{
+					c -= 1;
+					node = n.child + 1;
+				}
+				o[n.axis] = c;
+			}
+			return nodes[node].trees.get();
+		}
+
+		// Splits leaves that recorded more than _sampleThreshold_ samples
+		// in the last pass, then samples each leaf's new radiance and
+		// refines its directional tree to record the next pass
+		void Refine(float sampleThreshold, float fluxThreshold)
+		{
+			// Children start with copies of their parent's trees and are
+			// assumed to get half of its samples
+			for (size_t i = 0; i < nodes.size(); ++i)
+			{
+				if (nodes[i].child != 0 ||
+					nodes[i].trees->building.nSamples <= sampleThreshold)
+					continue;
+				int child = int(nodes.size());
+				int axis = nodes[i].axis;
+				for (int c = 0; c < 2; ++c)
+				{
+					Node n;
+					n.axis = (axis + 1) % 3;
+					n.trees.reset(new DTreePair(*nodes[i].trees));
+					n.trees->building.nSamples = nodes[i].trees->building.nSamples / 2;
+					nodes.push_back(std::move(n));
+				}
+				nodes[i].child = child;
+				nodes[i].trees.reset();
+			}
+
+			std::vector<DTreePair*> leaves;
+			for (const Node& n : nodes)
+				if (n.child == 0)
+					leaves.push_back(n.trees.get());
+			ParallelFor([&](int64_t i) {
+				DTreePair& trees = *leaves[i];
+				// Regions no path reached keep guiding with what they had
+				if (trees.building.Total() > 0)
+					trees.sampling = trees.building;
+				trees.building.Refine(trees.sampling, fluxThreshold);
+				}, int64_t(leaves.size()));
+		}
+
+		struct Node
+		{
+			// Index of the first child, the second following it; zero for
+			// leaves, which hold _trees_
+			int child = 0;
+			int axis = 0;
+			std::unique_ptr<DTreePair> trees;
+		};
+		Bounds3f bounds;
+		std::vector<Node> nodes;
+	};
+
+	// A path vertex whose direction training records, with the radiance
+	// that arrived along it
+	struct GuidingVertex
+	{
+		DTreePair* trees;
+		Vector3f wi;
+		// Path throughput after the vertex, to turn contributions to the
+		// image into radiance arriving at it
+		Spectrum beta;
+		Spectrum radiance;
+		float pdf;
+	};
+
+	GuidedPathIntegrator::GuidedPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+		std::shared_ptr<Sampler> sampler, int trainingSpp, float bsdfSamplingFraction,
+		float spatialThreshold, const std::string& lightSampleStrategy)
+		: SamplerIntegrator(camera, sampler), maxDepth(maxDepth), trainingSpp(trainingSpp),
+		  bsdfSamplingFraction(bsdfSamplingFraction), spatialThreshold(spatialThreshold),
+		  lightSampleStrategy(lightSampleStrategy)
+	{}
+
+	GuidedPathIntegrator::~GuidedPathIntegrator() = default;
+
+	void GuidedPathIntegrator::Preprocess(const Scene& scene, Sampler& sampler)
+	{
+		lightDistribution = CreateLightSampleDistribution(lightSampleStrategy, scene);
+		sdTree.reset(new SDTree(scene.Worldbound()));
+
+		// Train in passes of doubling sample counts, so that most training
+		// samples are guided by a tree learned from many
+		training = true;
+		int passSpp = 1;
+		for (int iteration = 0, taken = 0; taken < trainingSpp; ++iteration)
+		{
+			int spp = std::min({ passSpp, trainingSpp - taken, int(sampler.samplesPerPixel) });
+			AuxiliaryPass(scene, sampler, GuidedTrainingPass + iteration, spp,
+				[](const Point2i&, const Spectrum&) {});
+			++nTrainingPasses;
+			taken += spp;
+			sdTree->Refine(spatialThreshold * std::sqrt(float(spp)), .01f);
+			passSpp *= 2;
+		}
+		training = false;
+		for (const SDTree::Node& n : sdTree->nodes)
+			if (n.child == 0)
+				++nSpatialLeaves;
+	}
+
+	Spectrum GuidedPathIntegrator::Li(const RayDifferential& r, const Scene& scene, Sampler& sampler,
+		MemoryArena& arena, int depth, AOVSample* aov) const
+	{
+		Spectrum L(0.f), beta(1.f);
+		RayDifferential ray(r);
+		bool specularBounce = false;
+		GuidingVertex* vertices = training ? arena.Alloc<GuidingVertex>(maxDepth + 1) : nullptr;
+		int nVertices = 0;
+		// Adds a contribution to the image to the radiance arriving at the
+		// first _nRecipients_ vertices. Emission that direct lighting
+		// accounts for is left out, so that the tree doesn't learn to aim
+		// at lights.
+		auto recordRadiance = [&](const Spectrum& contribution, int nRecipients) {
+			for (int v = 0; v < nRecipients; ++v)
+				for (int c = 0; c < Spectrum::nSamples; ++c)
+					if (vertices[v].beta[c] > 0)
+						vertices[v].radiance[c] += contribution[c] / vertices[v].beta[c];
+		};
+		for (int bounces = 0; ; ++bounces)
+		{
+			SurfaceInteraction isect;
+			bool foundIntersection = scene.Intersect(ray, &isect);
+			if (bounces == 0 || specularBounce)
+			{
+				Spectrum Le(0.f);
+				if (foundIntersection)
+					Le = isect.Le(-ray.d);
+				else
+					for (const auto& light : scene.lights)
+						Le += light->Le(ray);
+				L += beta * Le;
+				if (training)
+					recordRadiance(beta * Le, nVertices);
+			}
+			if (!foundIntersection || bounces >= maxDepth)
+				break;
+
+			isect.ComputeScatteringFunctions(ray, arena, true);
+			if (!isect.bsdf)
+			{
+				ray = isect.SpawnRay(ray.d);
+				bounces--;
+				continue;
+			}
+			if (bounces == 0)
+				RecordAOVSample(aov, r.o, isect);
+			Spectrum Ld = beta * UniformSampleOneLight(isect, scene, arena, sampler,
+				*lightDistribution);
+			L += Ld;
+			if (training)
+				recordRadiance(Ld, nVertices);
+
+			// Sample the BSDF or the tree for the next direction. The tree
+			// only covers the non-specular lobes, so it is used only where
+			// there are some and something has been learned.
+			DTreePair* trees = sdTree->Lookup(isect.p);
+			const DTree& guide = trees->sampling;
+			const bool guided = guide.Total() > 0 &&
+				isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) > 0;
+			const float alpha = bsdfSamplingFraction;
+			Vector3f wo = -ray.d, wi;
+			float pdf;
+			BxDFType flags = BxDFType(0);
+			Spectrum f;
+			Point2f u = sampler.Get2D();
+			if (!guided || u.x < alpha)
+			{
+				if (guided)
+					u.x /= alpha;
+				f = isect.bsdf->Sample_f(wo, &wi, u, &pdf, BSDF_ALL, &flags);
+				if (guided && pdf > 0)
+				{
+					if (flags & BSDF_SPECULAR)
+						pdf *= alpha;
+					else
+						pdf = alpha * pdf + (1 - alpha) * guide.Pdf(wi);
+				}
+			}
+			else
+			{
+				u.x = std::min((u.x - alpha) / (1 - alpha), OneMinusEpsilon);
+				wi = guide.Sample(u);
+				f = isect.bsdf->f(wo, wi);
+				pdf = alpha * isect.bsdf->Pdf(wo, wi) + (1 - alpha) * guide.Pdf(wi);
+			}
+			if (f.IsBlack() || pdf == 0.f)
+				break;
+			beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+			specularBounce = (flags & BSDF_SPECULAR) != 0;
+			if (training && !specularBounce)
+				vertices[nVertices++] = { trees, wi, beta, Spectrum(0.f), pdf };
+			ray = isect.SpawnRay(wi);
+
+			// Russian roulette
+			if (bounces > 3)
+			{
+				float q = std::max((float).05, 1 - beta.y());
+				if (sampler.Get1D() < q)
+					break;
+				beta /= 1 - q;
+			}
+		}
+		// The radiance over the sampling density estimates each
+		// quadrant's share of the incident radiance
+		for (int v = 0; v < nVertices; ++v)
+			vertices[v].trees->building.Record(vertices[v].wi,
+				std::max(0.f, vertices[v].radiance.y()) / vertices[v].pdf);
+		return L;
+	}
+
+	GuidedPathIntegrator* CreateGuidedPathIntegrator(const ParamSet& params,
+		std::shared_ptr<Sampler> sampler,
+		std::shared_ptr<const Camera> camera)
+	{
+		int maxDepth = params.FindOneInt("maxdepth", 5);
+		int trainingSpp = params.FindOneInt("trainingspp",
+			std::max<int>(1, int(sampler->samplesPerPixel / 4)));
+		// BSDF sampling has to stay possible for specular lobes
+		float bsdfFraction = Clamp(params.FindOneFloat("bsdfsamplingfraction", .5f), .05f, 1.f);
+		float spatialThreshold = params.FindOneFloat("spatialthreshold", 12000);
+		std::string lightStrategy =
+			params.FindOneString("lightsamplestrategy", "spatial");
+		return new GuidedPathIntegrator(maxDepth, camera, sampler, trainingSpp,
+			bsdfFraction, spatialThreshold, lightStrategy);
+	}
+}
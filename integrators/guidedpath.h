@@ -0,0 +1,48 @@
+#ifndef PBRT_INTEGRATORS_GUIDEDPATH_H
+#define PBRT_INTEGRATORS_GUIDEDPATH_H
+
+#include "core/integrator.h"
+#include "core/lightdistrib.h"
+
+namespace pbrt
+{
+	struct SDTree;
+
+	// Path tracer that learns the incident radiance in the scene during
+	// training passes, in a binary tree over space whose leaves each hold a
+	// quadtree over directions, and samples directions from it as well as
+	// from the BSDF, weighting the two with MIS. Each training pass is
+	// guided by what the passes before it learned.
+	class GuidedPathIntegrator : public SamplerIntegrator
+	{
+	public:
+		GuidedPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+			std::shared_ptr<Sampler> sampler, int trainingSpp,
+			float bsdfSamplingFraction, float spatialThreshold,
+			const std::string& lightSampleStrategy = "spatial");
+		~GuidedPathIntegrator();
+		void Preprocess(const Scene& scene, Sampler& sampler) override;
+		Spectrum Li(const RayDifferential& r, const Scene& scene, Sampler& sampler,
+			MemoryArena& arena, int depth, AOVSample* aov) const override;
+	private:
+		const int maxDepth;
+		// Samples per pixel spent on training before the image is rendered
+		const int trainingSpp;
+		// Probability of sampling the BSDF rather than the tree
+		const float bsdfSamplingFraction;
+		// Samples a spatial leaf records in a one-sample-per-pixel pass
+		// before it is split
+		const float spatialThreshold;
+		const std::string lightSampleStrategy;
+		std::shared_ptr<const LightDistribution> lightDistribution;
+		std::unique_ptr<SDTree> sdTree;
+		// Set while training passes record radiance into _sdTree_
+		bool training = false;
+	};
+
+	GuidedPathIntegrator* CreateGuidedPathIntegrator(const ParamSet& params,
+		std::shared_ptr<Sampler> sampler,
+		std::shared_ptr<const Camera> camera);
+}
+
+#endif
@@ -1,22 +1,208 @@
 #include "path.h"
 
+#include "core/camera.h"
+#include "core/film.h"
 #include "core/interaction.h"
+#include "core/memory.h"
+#include "core/parallel.h"
 #include "core/paramset.h"
 #include "core/sampler.h"
 #include "core/scene.h"
 
 namespace pbrt
 {
+	// Mean luminance that paths gathered from a point on, not counting
+	// the point's own emission, hashed by the grid cell it falls in. Each sample is added to cells at
+	// a few resolutions, and lookups use the finest cell with enough
+	// samples. Cells are claimed with CAS on first use and hold keys, so
+	// that colliding cells don't share their means
+	struct RadianceGrid
+	{
+		struct Cell
+		{
+			std::atomic<uint64_t> key{ 0 };
+			AtomicFloat sum;
+			std::atomic<int> count{ 0 };
+		};
+		static const int nLevels = 3;
+
+		RadianceGrid(const Bounds3f& bounds, int resolution, int nCells, int minCount)
+			: bounds(bounds), nCells(nCells), minCount(minCount), cells(new Cell[nCells])
+		{
+			Vector3f d = bounds.Diagonal();
+			invCellSize = resolution / std::max({ d.x, d.y, d.z, 1e-4f });
+		}
+
+		// Each level's cells are four times as wide as the one before.
+		// Keys are offset by one so that zero marks an empty cell
+		uint64_t Key(const Point3f& p, int level) const
+		{
+			Vector3f o = (p - bounds.pMin) * (invCellSize / (1 << (2 * level)));
+			uint64_t x = uint64_t(std::max(0, int(o.x))) & 0xfffff;
+			uint64_t y = uint64_t(std::max(0, int(o.y))) & 0xfffff;
+			uint64_t z = uint64_t(std::max(0, int(o.z))) & 0xfffff;
+			return ((uint64_t(level) << 60) | (x << 40) | (y << 20) | z) + 1;
+		}
+
+		void Add(const Point3f& p, float L)
+		{
+			for (int level = 0; level < nLevels; ++level)
+			{
+				uint64_t key = Key(p, level);
+				for (int probe = 0, c = Hash(key); probe < 8; ++probe, c = (c + 1) % nCells)
+				{
+					uint64_t k = cells[c].key.load(std::memory_order_acquire);
+					if (k == 0 && cells[c].key.compare_exchange_strong(k, key))
+						k = key;
+					if (k == key)
+					{
+						cells[c].sum.Add(L);
+						++cells[c].count;
+						break;
+					}
+				}
+			}
+		}
+
+		// Returns false if no cell around _p_ has enough samples
+		bool Lookup(const Point3f& p, float* L) const
+		{
+			for (int level = 0; level < nLevels; ++level)
+			{
+				uint64_t key = Key(p, level);
+				for (int probe = 0, c = Hash(key); probe < 8; ++probe, c = (c + 1) % nCells)
+				{
+					uint64_t k = cells[c].key.load(std::memory_order_acquire);
+					if (k == 0)
+						break;
+					if (k == key)
+					{
+						int count = cells[c].count;
+						if (count < minCount)
+							break;
+						*L = cells[c].sum / count;
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+		int Hash(uint64_t key) const
+		{
+			key ^= key >> 31;
+			key *= 0x7fb5d329728ea185ull;
+			key ^= key >> 27;
+			return int(key % uint64_t(nCells));
+		}
+
+		const Bounds3f bounds;
+		float invCellSize;
+		const int nCells, minCount;
+		std::unique_ptr<Cell[]> cells;
+	};
+
+	// Path state the prepass keeps to find what each vertex gathered
+	struct PrepassVertex
+	{
+		Point3f p;
+		float beta, L;
+	};
+
+	// Continuation split off a path at _isect_. Its light sample and
+	// direction are only drawn once the path ends, so that splitting
+	// doesn't shift the sample dimensions the path uses.
+	struct SplitPath
+	{
+		SurfaceInteraction isect;
+		Spectrum beta;
+		int bounces;
+		SplitPath* next;
+	};
+
+	// Weight windows span a factor of this around their center
+	static const float kWindowSpread = 5;
+	// Highest weight roulette raises a path to, so that a cell whose
+	// estimate is too low can't turn its paths into fireflies
+	static const float kMaxWeight = 2;
+	// Most continuations a vertex splits into, and most paths a camera
+	// sample may split into overall
+	static const int kMaxSplit = 8, kMaxPaths = 32;
+
 	PathIntegrator::PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera, std::shared_ptr<Sampler> sampler,
-		const Bounds2i& pixelBounds, float rrThreshold, const std::string& lightSampleStrategy)
-		: SamplerIntegrator(camera, sampler), maxDepth(maxDepth), rrThreshold(rrThreshold)
+		const Bounds2i& pixelBounds, float rrThreshold, const std::string& lightSampleStrategy,
+		const std::string& rrStrategy, int prepassSpp)
+		: SamplerIntegrator(camera, sampler), maxDepth(maxDepth), rrThreshold(rrThreshold),
+		  lightSampleStrategy(lightSampleStrategy), rrStrategy(rrStrategy), prepassSpp(prepassSpp)
 	{}
-	Spectrum PathIntegrator::Li(const RayDifferential& r, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const
+
+	PathIntegrator::~PathIntegrator() {}
+
+	void PathIntegrator::Preprocess(const Scene& scene, Sampler& sampler)
+	{
+		lightDistribution = CreateLightSampleDistribution(lightSampleStrategy, scene);
+		if (rrStrategy == "adrrs" && prepassSpp > 0)
+			Prepass(scene, sampler);
+	}
+
+	void PathIntegrator::Prepass(const Scene& scene, Sampler& sampler)
+	{
+		radianceGrid.reset(new RadianceGrid(scene.Worldbound(), 256, 1 << 20, 16));
+		estimateBounds = camera->film->GetSampleBounds();
+		const Vector2i extent = estimateBounds.Diagonal();
+		std::vector<float> sums(extent.x * extent.y, 0.f);
+
+		const int spp = std::min(prepassSpp, int(sampler.samplesPerPixel));
+		prepass = true;
+		AuxiliaryPass(scene, sampler, PathPrepass, spp,
+			[&](const Point2i& pixel, const Spectrum& L) {
+				Vector2i o = pixel - estimateBounds.pMin;
+				sums[o.y * extent.x + o.x] += L.y() / spp;
+			});
+		prepass = false;
+
+		// A few samples per pixel are noisy, so estimate each pixel by the
+		// mean of its 3x3 neighborhood, and keep dark estimates from
+		// splitting every path that reaches a lit region
+		double mean = 0;
+		for (float s : sums)
+			mean += s;
+		const float minEstimate = std::max(.01f * float(mean / sums.size()), 1e-4f);
+		pixelEstimates.resize(sums.size());
+		for (int y = 0; y < extent.y; ++y)
+			for (int x = 0; x < extent.x; ++x)
+			{
+				float sum = 0;
+				int n = 0;
+				for (int dy = std::max(y - 1, 0); dy <= std::min(y + 1, extent.y - 1); ++dy)
+					for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, extent.x - 1); ++dx, ++n)
+						sum += sums[dy * extent.x + dx];
+				pixelEstimates[y * extent.x + x] = std::max(sum / n, minEstimate);
+			}
+	}
+
+	Spectrum PathIntegrator::Li(const RayDifferential& r, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth, AOVSample* aov) const
 	{
-		Spectrum L(0.f), beta(1.f);
+		float pixelEstimate = 0;
+		const Point2i& pixel = sampler.CurrentPixel();
+		if (!pixelEstimates.empty() && InsideExclusive(pixel, estimateBounds))
+			pixelEstimate = pixelEstimates[(pixel.y - estimateBounds.pMin.y) *
+				estimateBounds.Diagonal().x + (pixel.x - estimateBounds.pMin.x)];
+		int nPaths = 1;
+		return TracePath(r, scene, sampler, arena, aov, Spectrum(1.f), 0, false,
+			pixelEstimate, &nPaths);
+	}
+
+	Spectrum PathIntegrator::TracePath(const RayDifferential& r, const Scene& scene, Sampler& sampler,
+		MemoryArena& arena, AOVSample* aov, Spectrum beta, int bounces, bool specularBounce,
+		float pixelEstimate, int* nPaths) const
+	{
+		Spectrum L(0.f);
 		RayDifferential ray(r);
-		bool specularBounce = false;
-		for(int bounces = 0; ;++bounces)
+		PrepassVertex* vertices = prepass ? arena.Alloc<PrepassVertex>(maxDepth + 1) : nullptr;
+		int nVertices = 0;
+		SplitPath* splits = nullptr;
+		for(; ;++bounces)
 		{
 			SurfaceInteraction isect;
 			bool foundIntersection = scene.Intersect(ray, &isect);
@@ -38,13 +224,51 @@ namespace pbrt
 				bounces--;
 				continue;
 			}
-			L += beta * UniformSampleOneLight(isect, scene, arena, sampler);
+			if (bounces == 0)
+				RecordAOVSample(aov, r.o, isect);
+			if (vertices)
+				vertices[nVertices++] = { isect.p, beta.y(), L.y() };
+
+			// Drawn at every vertex whether or not it is used, so that the
+			// dimensions later vertices use line up across the pixel's samples
+			const float uRoulette = sampler.Get1D();
+
+			// Compare the throughput with the window around the one at which
+			// the rest of the path would add the pixel's estimate: roulette
+			// below it, split above it
+			float Lr;
+			bool windowed = pixelEstimate > 0 && radianceGrid->Lookup(isect.p, &Lr);
+			int nSplits = 1;
+			if (windowed)
+			{
+				float w = beta.y();
+				float center = std::min(kMaxWeight, pixelEstimate / std::max(Lr, 1e-6f));
+				float lower = 2 * center / (1 + kWindowSpread), upper = kWindowSpread * lower;
+				if (w < lower)
+				{
+					float survival = std::max(.05f, w / center);
+					if (uRoulette >= survival)
+						break;
+					beta /= survival;
+				}
+				else if (w > upper)
+				{
+					nSplits = std::min({ int(w / center), kMaxSplit, kMaxPaths - *nPaths + 1 });
+					*nPaths += nSplits - 1;
+					beta /= nSplits;
+				}
+			}
+
+			L += beta * UniformSampleOneLight(isect, scene, arena, sampler,
+				*lightDistribution);
 
 			// Sample BSDF direction
 			Vector3f wo = -ray.d, wi;
 			float pdf;
 			BxDFType flags;
 			Spectrum f = isect.bsdf->Sample_f(wo, &wi, sampler.Get2D(), &pdf, BSDF_ALL, &flags);
+			for (int i = 1; i < nSplits; ++i)
+				splits = ARENA_ALLOC(arena, SplitPath){ isect, beta, bounces, splits };
 			if (f.IsBlack() || pdf == 0.f)
 				break;
 			beta *= f * AbsDot(wi, isect.shading.n) / pdf;
@@ -53,15 +277,37 @@ namespace pbrt
 			// TODO Account for subsurface scattering, if applicable
 
 			// Russian roulette
-			if (bounces > 3)
+			if (!windowed && beta.y() < rrThreshold && bounces > 3)
 			{
 				float q = std::max((float).05, 1 - beta.y());
-				if (sampler.Get1D() < q)
+				if (uRoulette < q)
 					break;
 				beta /= 1 - q;
-					
 			}
 		}
+		// Record what the path gathered from each vertex on, in the units
+		// of radiance leaving it
+		for (int i = 0; i < nVertices; ++i)
+			if (vertices[i].beta > 0)
+				radianceGrid->Add(vertices[i].p, (L.y() - vertices[i].L) / vertices[i].beta);
+		// Each split takes its own light sample and direction, as the path
+		// did at the vertex it split from
+		for (SplitPath* s = splits; s; s = s->next)
+		{
+			const SurfaceInteraction& si = s->isect;
+			L += s->beta * UniformSampleOneLight(si, scene, arena, sampler,
+				*lightDistribution);
+			Vector3f wiSplit;
+			float pdfSplit;
+			BxDFType flagsSplit;
+			Spectrum fSplit = si.bsdf->Sample_f(si.wo, &wiSplit, sampler.Get2D(), &pdfSplit,
+				BSDF_ALL, &flagsSplit);
+			if (fSplit.IsBlack() || pdfSplit == 0.f)
+				continue;
+			L += TracePath(si.SpawnRay(wiSplit), scene, sampler, arena, nullptr,
+				s->beta * fSplit * AbsDot(wiSplit, si.shading.n) / pdfSplit, s->bounces + 1,
+				(flagsSplit & BSDF_SPECULAR) != 0, pixelEstimate, nPaths);
+		}
 		return L;
 	}
 
@@ -86,7 +332,15 @@ namespace pbrt
 		float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
 		std::string lightStrategy =
 			params.FindOneString("lightsamplestrategy", "spatial");
+		std::string rrStrategy = params.FindOneString("rrstrategy", "adrrs");
+		if (rrStrategy != "adrrs" && rrStrategy != "threshold")
+		{
+			Warning("Russian roulette strategy \"%s\" unknown. Using \"adrrs\".",
+				rrStrategy.c_str());
+			rrStrategy = "adrrs";
+		}
+		int prepassSpp = params.FindOneInt("prepassspp", 2);
 		return new PathIntegrator(maxDepth, camera, sampler, pixelBounds,
-			rrThreshold, lightStrategy);
+			rrThreshold, lightStrategy, rrStrategy, prepassSpp);
 	}
 }
@@ -2,19 +2,44 @@
 #define PBRT_INTEGRATORS_PATH_H
 
 #include "core/integrator.h"
+#include "core/lightdistrib.h"
 
 namespace pbrt
 {
+	struct RadianceGrid;
+
 	class PathIntegrator : public SamplerIntegrator
 	{
 	public:
 		PathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera, std::shared_ptr<Sampler> sampler,
 			const Bounds2i& pixelBounds, float rrThreshold = 1,
-			const std::string& lightSampleStrategy = "spatial");
-		Spectrum Li(const RayDifferential& r, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const override;
+			const std::string& lightSampleStrategy = "spatial",
+			const std::string& rrStrategy = "adrrs", int prepassSpp = 2);
+		~PathIntegrator();
+		void Preprocess(const Scene& scene, Sampler& sampler) override;
+		Spectrum Li(const RayDifferential& r, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth, AOVSample* aov) const override;
 	private:
+		Spectrum TracePath(const RayDifferential& r, const Scene& scene, Sampler& sampler,
+			MemoryArena& arena, AOVSample* aov, Spectrum beta, int bounces,
+			bool specularBounce, float pixelEstimate, int* nPaths) const;
+		void Prepass(const Scene& scene, Sampler& sampler);
+
 		const int maxDepth;
 		const float rrThreshold;
+		// "uniform", "power" or "spatial"
+		const std::string lightSampleStrategy;
+		// "adrrs" roulettes and splits paths by their expected contribution
+		// to the pixel, "threshold" only roulettes low-throughput paths
+		const std::string rrStrategy;
+		const int prepassSpp;
+		std::shared_ptr<const LightDistribution> lightDistribution;
+		// Prepass estimates of each pixel's luminance and of the luminance
+		// paths gather from each region of the scene on
+		Bounds2i estimateBounds;
+		std::vector<float> pixelEstimates;
+		std::unique_ptr<RadianceGrid> radianceGrid;
+		// Set while the prepass records into _radianceGrid_
+		bool prepass = false;
 	};
 
 	PathIntegrator* CreatePathIntegrator(const ParamSet& params,
@@ -22,4 +47,4 @@ namespace pbrt
 		std::shared_ptr<const Camera> camera);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,419 @@
+#include "sppm.h"
+
+#include "core/camera.h"
+#include "core/film.h"
+#include "core/interaction.h"
+#include "core/light.h"
+#include "core/lightdistrib.h"
+#include "core/memory.h"
+#include "core/parallel.h"
+#include "core/paramset.h"
+#include "core/reflection.h"
+#include "core/rng.h"
+#include "core/sampler.h"
+#include "core/scene.h"
+#include "core/stats.h"
+
+namespace pbrt
+{
+	STAT_COUNTER("Integrator/SPPM photon paths", nPhotonPaths);
+	STAT_COUNTER("Integrator/SPPM visible points checked", nVisiblePointsChecked);
+	STAT_COUNTER("Integrator/SPPM grid cells per iteration", nGridCells);
+
+	struct SPPMPixel
+	{
+		float radius = 0;
+		// Direct lighting and emission seen by the camera paths
+		Spectrum Ld;
+		// Where this iteration's camera path stopped, with the path's
+		// throughput up to there; _bsdf_ is null if it escaped
+		struct VisiblePoint
+		{
+			Point3f p;
+			Vector3f wo;
+			const BSDF* bsdf = nullptr;
+			Spectrum beta;
+		} vp;
+		// Photons found this iteration, added from any thread
+		AtomicFloat Phi[Spectrum::nSamples];
+		std::atomic<int> M{ 0 };
+		// Photon count and flux accumulated over the iterations so far
+		float N = 0;
+		Spectrum tau;
+	};
+
+	// Grid cells hold singly linked lists of the visible points that may
+	// be within their radius of a point in the cell
+	struct SPPMPixelListNode
+	{
+		SPPMPixel* pixel;
+		SPPMPixelListNode* next;
+	};
+
+	static bool ToGrid(const Point3f& p, const Bounds3f& bounds, const int gridRes[3],
+		Point3i* pi)
+	{
+		bool inBounds = true;
+		Vector3f pg = bounds.Offset(p);
+		for (int i = 0; i < 3; ++i)
+		{
+			(*pi)[i] = int(gridRes[i] * pg[i]);
+			inBounds &= (*pi)[i] >= 0 && (*pi)[i] < gridRes[i];
+			(*pi)[i] = Clamp((*pi)[i], 0, gridRes[i] - 1);
+		}
+		return inBounds;
+	}
+
+	static inline unsigned int HashGridCell(const Point3i& p, int hashSize)
+	{
+		return (unsigned int)((p.x * 73856093) ^ (p.y * 19349663) ^ (p.z * 83492791)) %
+			hashSize;
+	}
+
+	SPPMIntegrator::SPPMIntegrator(std::shared_ptr<const Camera> camera,
+		std::shared_ptr<Sampler> sampler, int nIterations, int photonsPerIteration,
+		int maxDepth, float initialSearchRadius, int writeFrequency)
+		: camera(std::move(camera)), sampler(std::move(sampler)), nIterations(nIterations),
+		  photonsPerIteration(photonsPerIteration), maxDepth(maxDepth),
+		  initialSearchRadius(initialSearchRadius), writeFrequency(writeFrequency)
+	{}
+
+	void SPPMIntegrator::Render(const Scene& scene)
+	{
+		Film* film = camera->film;
+		// Without lights there is nothing to emit photons from, and the
+		// power distribution would be empty; the image is black
+		if (scene.lights.empty())
+		{
+			film->WriteImage();
+			return;
+		}
+		const Bounds2i pixelBounds = film->croppedPixelBounds;
+		const int nPixels = pixelBounds.Area();
+		std::unique_ptr<SPPMPixel[]> pixels(new SPPMPixel[nPixels]);
+		for (int i = 0; i < nPixels; ++i)
+			pixels[i].radius = initialSearchRadius;
+		auto pixelOffset = [&](const Point2i& p) {
+			return (p.x - pixelBounds.pMin.x) +
+				(p.y - pixelBounds.pMin.y) * (pixelBounds.pMax.x - pixelBounds.pMin.x);
+		};
+		const int photons = photonsPerIteration > 0 ? photonsPerIteration : nPixels;
+		std::shared_ptr<const LightDistribution> lightDistr =
+			CreateLightSampleDistribution("power", scene);
+
+		const int tileSize = 16;
+		const Point2i nTiles((pixelBounds.Diagonal().x + tileSize - 1) / tileSize,
+			(pixelBounds.Diagonal().y + tileSize - 1) / tileSize);
+		const int64_t spp = sampler->samplesPerPixel;
+		// Visible points' BSDFs are needed until the photons of their
+		// iteration have been traced, so the camera pass allocates them
+		// from arenas that are only reset at the end of the iteration
+		std::vector<MemoryArena> cameraArenas(MaxThreadIndex());
+		for (int iter = 0; iter < nIterations; ++iter)
+		{
+			// Trace a camera path for each pixel. Iterations take the
+			// pixel's samples in order, reseeding after each _spp_ of them.
+			ParallelFor2D([&](Point2i tile) {
+				MemoryArena& arena = cameraArenas[ThreadIndex];
+				int tileIndex = tile.y * nTiles.x + tile.x;
+				std::unique_ptr<Sampler> tileSampler =
+					sampler->Clone(int(tileIndex + (iter / spp) * nTiles.x * nTiles.y));
+				Point2i p0 = pixelBounds.pMin + Vector2i(tile.x * tileSize, tile.y * tileSize);
+				Bounds2i tileBounds(p0, Point2i(std::min(p0.x + tileSize, pixelBounds.pMax.x),
+					std::min(p0.y + tileSize, pixelBounds.pMax.y)));
+				for (Point2i pPixel : tileBounds)
+				{
+					tileSampler->StartPixel(pPixel);
+					tileSampler->SetSampleNumber(iter % spp);
+					CameraSample cameraSample = tileSampler->GetCameraSample(pPixel);
+					RayDifferential ray;
+					Spectrum beta(camera->GenerateRayDifferential(cameraSample, &ray));
+					if (beta.IsBlack())
+						continue;
+					ray.ScaleDifferentials(1 / std::sqrt(float(spp)));
+
+					SPPMPixel& pixel = pixels[pixelOffset(pPixel)];
+					bool specularBounce = false;
+					for (int depth = 0; depth < maxDepth; ++depth)
+					{
+						SurfaceInteraction isect;
+						if (!scene.Intersect(ray, &isect))
+						{
+							for (const auto& light : scene.lights)
+								pixel.Ld += beta * light->Le(ray);
+							break;
+						}
+						isect.ComputeScatteringFunctions(ray, arena, true);
+						if (!isect.bsdf)
+						{
+							ray = isect.SpawnRay(ray.d);
+							--depth;
+							continue;
+						}
+						const BSDF& bsdf = *isect.bsdf;
+						Vector3f wo = -ray.d;
+						if (depth == 0 || specularBounce)
+							pixel.Ld += beta * isect.Le(wo);
+						pixel.Ld += beta * UniformSampleOneLight(isect, scene, arena, *tileSampler);
+
+						// Stop at diffuse surfaces, and at glossy ones if the
+						// path can't go further
+						bool isDiffuse = bsdf.NumComponents(BxDFType(BSDF_DIFFUSE |
+							BSDF_REFLECTION | BSDF_TRANSMISSION)) > 0;
+						bool isGlossy = bsdf.NumComponents(BxDFType(BSDF_GLOSSY |
+							BSDF_REFLECTION | BSDF_TRANSMISSION)) > 0;
+						if (isDiffuse || (isGlossy && depth == maxDepth - 1))
+						{
+							pixel.vp = { isect.p, wo, &bsdf, beta };
+							break;
+						}
+						if (depth < maxDepth - 1)
+						{
+							float pdf;
+							Vector3f wi;
+							BxDFType type;
+							Spectrum f = bsdf.Sample_f(wo, &wi, tileSampler->Get2D(), &pdf,
+								BSDF_ALL, &type);
+							if (pdf == 0.f || f.IsBlack())
+								break;
+							specularBounce = (type & BSDF_SPECULAR) != 0;
+							beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+							if (beta.y() < .25f)
+							{
+								float continueProb = std::min(1.f, beta.y());
+								if (tileSampler->Get1D() > continueProb)
+									break;
+								beta /= continueProb;
+							}
+							ray = isect.SpawnRay(wi);
+						}
+					}
+				}
+				}, nTiles);
+
+			// Size the grid so that its cells are about as large as the
+			// largest search radius; each visible point then overlaps at
+			// most eight of them
+			Bounds3f gridBounds;
+			float maxRadius = 0;
+			for (int i = 0; i < nPixels; ++i)
+			{
+				const SPPMPixel& pixel = pixels[i];
+				if (pixel.vp.beta.IsBlack())
+					continue;
+				Vector3f r(pixel.radius, pixel.radius, pixel.radius);
+				gridBounds = Union(gridBounds, Bounds3f(pixel.vp.p - r, pixel.vp.p + r));
+				maxRadius = std::max(maxRadius, pixel.radius);
+			}
+			int gridRes[3];
+			Vector3f diag = gridBounds.Diagonal();
+			float maxDiag = MaxComponent(diag);
+			int baseGridRes = maxRadius > 0 ? int(maxDiag / maxRadius) : 1;
+			for (int i = 0; i < 3; ++i)
+				gridRes[i] = std::max(int(baseGridRes * diag[i] / maxDiag), 1);
+			nGridCells += int64_t(gridRes[0]) * gridRes[1] * gridRes[2];
+
+			// Add the visible points to the grid from all threads at once:
+			// list nodes come from an arena shared by all threads, and each
+			// node is pushed onto its cell's list with compare-and-swap
+			const int hashSize = nPixels;
+			std::vector<std::atomic<SPPMPixelListNode*>> grid(hashSize);
+			ConcurrentMemoryArena gridArena;
+			ParallelFor([&](int64_t pixelIndex) {
+				SPPMPixel& pixel = pixels[pixelIndex];
+				if (pixel.vp.beta.IsBlack())
+					return;
+				float radius = pixel.radius;
+				Point3i pMin, pMax;
+				ToGrid(pixel.vp.p - Vector3f(radius, radius, radius), gridBounds, gridRes, &pMin);
+				ToGrid(pixel.vp.p + Vector3f(radius, radius, radius), gridBounds, gridRes, &pMax);
+				for (int z = pMin.z; z <= pMax.z; ++z)
+					for (int y = pMin.y; y <= pMax.y; ++y)
+						for (int x = pMin.x; x <= pMax.x; ++x)
+						{
+							int h = HashGridCell(Point3i(x, y, z), hashSize);
+							SPPMPixelListNode* node = gridArena.Alloc<SPPMPixelListNode>();
+							node->pixel = &pixel;
+							node->next = grid[h].load(std::memory_order_relaxed);
+							while (!grid[h].compare_exchange_weak(node->next, node))
+								;
+						}
+				}, nPixels, 4096);
+
+			// Trace photons and add them to the visible points they reach.
+			// Each photon path draws its random numbers from its own
+			// sequence. Photons are added to the visible points' flux with
+			// atomic adds as they are found, whose order depends on thread
+			// timing; deterministic renders instead collect each chunk's
+			// photons and add them in photon order afterwards.
+			struct PhotonDeposit
+			{
+				SPPMPixel* pixel;
+				Spectrum Phi;
+			};
+			const int64_t photonChunkSize = 8192;
+			const int64_t nPhotonChunks = (photons + photonChunkSize - 1) / photonChunkSize;
+			std::vector<std::vector<PhotonDeposit>> deposits(
+				PbrtOptions.deterministic ? nPhotonChunks : 0);
+			auto tracePhoton = [&](int64_t photonIndex, std::vector<PhotonDeposit>* chunkDeposits) {
+				MemoryArena& arena = PerThreadArena();
+				RNG rng(uint64_t(iter) * photons + photonIndex);
+				float lightPdf;
+				int lightNum = lightDistr->Sample(Point3f(0, 0, 0), Normal3f(0, 0, 0), rng.UniformFloat(),
+					&lightPdf);
+				if (lightNum < 0)
+					return;
+				const std::shared_ptr<Light>& light = scene.lights[lightNum];
+				Point2f uLight0(rng.UniformFloat(), rng.UniformFloat());
+				Point2f uLight1(rng.UniformFloat(), rng.UniformFloat());
+				float uLightTime = Lerp(rng.UniformFloat(), camera->shutterOpen,
+					camera->shutterClose);
+				RayDifferential photonRay;
+				Normal3f nLight;
+				float pdfPos, pdfDir;
+				Spectrum Le = light->Sample_Le(uLight0, uLight1, uLightTime, &photonRay,
+					&nLight, &pdfPos, &pdfDir);
+				if (pdfPos == 0 || pdfDir == 0 || Le.IsBlack())
+					return;
+				Spectrum beta = (AbsDot(nLight, photonRay.d) * Le) /
+					(lightPdf * pdfPos * pdfDir);
+				if (beta.IsBlack())
+					return;
+				++nPhotonPaths;
+
+				for (int depth = 0; depth < maxDepth; ++depth)
+				{
+					SurfaceInteraction isect;
+					if (!scene.Intersect(photonRay, &isect))
+						break;
+					// Light arriving directly from the light is accounted
+					// for by direct lighting at the visible points
+					Point3i photonGridIndex;
+					if (depth > 0 && ToGrid(isect.p, gridBounds, gridRes, &photonGridIndex))
+					{
+						int h = HashGridCell(photonGridIndex, hashSize);
+						for (SPPMPixelListNode* node = grid[h].load(std::memory_order_relaxed);
+							node; node = node->next)
+						{
+							++nVisiblePointsChecked;
+							SPPMPixel& pixel = *node->pixel;
+							float radius = pixel.radius;
+							if (DistanceSquared(pixel.vp.p, isect.p) > radius * radius)
+								continue;
+							Spectrum Phi = beta * pixel.vp.bsdf->f(pixel.vp.wo, -photonRay.d);
+							if (chunkDeposits)
+								chunkDeposits->push_back({ &pixel, Phi });
+							else
+							{
+								for (int i = 0; i < Spectrum::nSamples; ++i)
+									pixel.Phi[i].Add(Phi[i]);
+								++pixel.M;
+							}
+						}
+					}
+
+					isect.ComputeScatteringFunctions(photonRay, arena, true,
+						TransportMode::Importance);
+					if (!isect.bsdf)
+					{
+						--depth;
+						photonRay = isect.SpawnRay(photonRay.d);
+						continue;
+					}
+					Vector3f wi, wo = -photonRay.d;
+					float pdf;
+					BxDFType flags;
+					Point2f u(rng.UniformFloat(), rng.UniformFloat());
+					Spectrum fr = isect.bsdf->Sample_f(wo, &wi, u, &pdf, BSDF_ALL, &flags);
+					if (fr.IsBlack() || pdf == 0.f)
+						break;
+					Spectrum bnew = beta * fr * AbsDot(wi, isect.shading.n) / pdf;
+
+					// Russian roulette keeps the photon's power about constant
+					float q = std::max(0.f, 1 - bnew.y() / beta.y());
+					if (rng.UniformFloat() < q)
+						break;
+					beta = bnew / (1 - q);
+					photonRay = isect.SpawnRay(wi);
+				}
+				arena.Reset();
+			};
+			ParallelFor([&](int64_t chunk) {
+				std::vector<PhotonDeposit>* chunkDeposits =
+					PbrtOptions.deterministic ? &deposits[chunk] : nullptr;
+				for (int64_t i = chunk * photonChunkSize;
+					i < std::min<int64_t>(photons, (chunk + 1) * photonChunkSize); ++i)
+					tracePhoton(i, chunkDeposits);
+				}, nPhotonChunks);
+			for (const std::vector<PhotonDeposit>& chunkDeposits : deposits)
+				for (const PhotonDeposit& d : chunkDeposits)
+				{
+					for (int i = 0; i < Spectrum::nSamples; ++i)
+						d.pixel->Phi[i].Add(d.Phi[i]);
+					++d.pixel->M;
+				}
+
+			// Shrink the radii of the points that found photons and fold
+			// the photons into their flux
+			ParallelFor([&](int64_t i) {
+				SPPMPixel& p = pixels[i];
+				if (p.M > 0)
+				{
+					const float gamma = 2.f / 3.f;
+					float Nnew = p.N + gamma * p.M;
+					float Rnew = p.radius * std::sqrt(Nnew / (p.N + p.M));
+					Spectrum Phi;
+					for (int j = 0; j < Spectrum::nSamples; ++j)
+					{
+						Phi[j] = p.Phi[j];
+						p.Phi[j] = 0;
+					}
+					p.tau = (p.tau + p.vp.beta * Phi) * (Rnew * Rnew) / (p.radius * p.radius);
+					p.N = Nnew;
+					p.radius = Rnew;
+					p.M = 0;
+				}
+				p.vp.beta = Spectrum(0.f);
+				p.vp.bsdf = nullptr;
+				}, nPixels, 4096);
+			for (MemoryArena& arena : cameraArenas)
+				arena.Reset();
+
+			if (iter + 1 == nIterations || (iter + 1) % writeFrequency == 0)
+			{
+				const uint64_t Np = uint64_t(iter + 1) * photons;
+				std::unique_ptr<Spectrum[]> image(new Spectrum[nPixels]);
+				for (int i = 0; i < nPixels; ++i)
+				{
+					const SPPMPixel& p = pixels[i];
+					image[i] = p.Ld / (iter + 1) +
+						p.tau / (Np * Pi * p.radius * p.radius);
+				}
+				film->SetImage(image.get());
+				if (iter + 1 == nIterations)
+					film->WriteImage();
+				else
+					film->WriteImageAsync();
+			}
+		}
+	}
+
+	SPPMIntegrator* CreateSPPMIntegrator(const ParamSet& params,
+		std::shared_ptr<Sampler> sampler,
+		std::shared_ptr<const Camera> camera)
+	{
+		int nIterations = params.FindOneInt("numiterations", 64);
+		int maxDepth = params.FindOneInt("maxdepth", 5);
+		// Defaults to one photon per pixel
+		int photonsPerIter = params.FindOneInt("photonsperiteration", -1);
+		int writeFreq = params.FindOneInt("imagewritefrequency", 1 << 30);
+		float radius = params.FindOneFloat("radius", 1.f);
+		if (camera->film->GetBandHeight() > 0)
+		{
+			Error("The \"sppm\" integrator doesn't support streaming films");
+			return nullptr;
+		}
+		return new SPPMIntegrator(camera, sampler, nIterations, photonsPerIter,
+			maxDepth, radius, std::max(writeFreq, 1));
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef PBRT_INTEGRATORS_SPPM_H
+#define PBRT_INTEGRATORS_SPPM_H
+
+#include "core/integrator.h"
+
+namespace pbrt
+{
+	// Stochastic progressive photon mapping. Each iteration traces one
+	// camera path per pixel to its first diffuse surface, stores that
+	// visible point in a spatial hash grid, then traces photons from the
+	// lights and adds each one to the visible points around where it lands.
+	// The points' gathering radii shrink over the iterations, so the result
+	// converges even for caustics that paths from the camera can't find.
+	class SPPMIntegrator : public Integrator
+	{
+	public:
+		SPPMIntegrator(std::shared_ptr<const Camera> camera, std::shared_ptr<Sampler> sampler,
+			int nIterations, int photonsPerIteration, int maxDepth,
+			float initialSearchRadius, int writeFrequency);
+		void Render(const Scene& scene) override;
+	private:
+		std::shared_ptr<const Camera> camera;
+		std::shared_ptr<Sampler> sampler;
+		const int nIterations;
+		// Photon paths traced per iteration
+		const int photonsPerIteration;
+		const int maxDepth;
+		const float initialSearchRadius;
+		// Iterations between writes of the image so far
+		const int writeFrequency;
+	};
+
+	SPPMIntegrator* CreateSPPMIntegrator(const ParamSet& params,
+		std::shared_ptr<Sampler> sampler,
+		std::shared_ptr<const Camera> camera);
+}
+
+#endif
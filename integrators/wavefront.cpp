@@ -0,0 +1,512 @@
+#include "wavefront.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include "core/camera.h"
+#include "core/film.h"
+#include "core/interaction.h"
+#include "core/light.h"
+#include "core/memory.h"
+#include "core/parallel.h"
+#include "core/paramset.h"
+#include "core/rng.h"
+#include "core/sampler.h"
+#include "core/scene.h"
+#include "core/stats.h"
+
+namespace pbrt
+{
+	STAT_COUNTER("Integrator/Wavefront waves", nWaves);
+	STAT_COUNTER("Integrator/Wavefront shadow rays", nShadowRays);
+
+	// Work items are handed to threads in chunks of this many queue entries
+	static constexpr int QueueChunkSize = 64;
+
+	// Rays stored as one array per component; entries are appended from any
+	// thread through _size_
+	struct RayQueue
+	{
+		std::vector<float> ox, oy, oz, dx, dy, dz, tMax, time;
+		std::vector<const Medium*> medium;
+		std::vector<int> pathIndex;
+		std::atomic<int> size{ 0 };
+		void Resize(int n)
+		{
+			for (std::vector<float>* v : { &ox, &oy, &oz, &dx, &dy, &dz, &tMax, &time })
+				v->resize(n);
+			medium.resize(n);
+			pathIndex.resize(n);
+			size = 0;
+		}
+		int Push(const Ray& ray, int path)
+		{
+			int i = size++;
+			ox[i] = ray.o.x; oy[i] = ray.o.y; oz[i] = ray.o.z;
+			dx[i] = ray.d.x; dy[i] = ray.d.y; dz[i] = ray.d.z;
+			tMax[i] = ray.tMax;
+			time[i] = ray.time;
+			medium[i] = ray.medium;
+			pathIndex[i] = path;
+			return i;
+		}
+		void Swap(RayQueue& other)
+		{
+			ox.swap(other.ox); oy.swap(other.oy); oz.swap(other.oz);
+			dx.swap(other.dx); dy.swap(other.dy); dz.swap(other.dz);
+			tMax.swap(other.tMax);
+			time.swap(other.time);
+			medium.swap(other.medium);
+			pathIndex.swap(other.pathIndex);
+			int n = size;
+			size = other.size.load();
+			other.size = n;
+		}
+		Ray Get(int i) const
+		{
+			return Ray(Point3f(ox[i], oy[i], oz[i]), Vector3f(dx[i], dy[i], dz[i]),
+				tMax[i], time[i], medium[i]);
+		}
+	};
+
+	// Paths whose rays hit a surface, keyed by the surface's material
+	struct HitQueue
+	{
+		std::vector<int> pathIndex;
+		std::vector<const Material*> material;
+		std::atomic<int> size{ 0 };
+		void Resize(int n)
+		{
+			pathIndex.resize(n);
+			material.resize(n);
+			size = 0;
+		}
+		void Push(int path, const Material* m)
+		{
+			int i = size++;
+			pathIndex[i] = path;
+			material[i] = m;
+		}
+	};
+
+	struct WavefrontPathIntegrator::WaveTile
+	{
+		Bounds2i bounds;
+		int seed;
+		int firstPath, nPaths;
+	};
+
+	// State of every path in flight, one array per field, indexed by path
+	struct WavefrontPathIntegrator::Wave
+	{
+		int nPaths = 0;
+		// Camera sample of each path
+		std::vector<Point2i> pixel;
+		std::vector<Point2f> pFilm;
+		std::vector<float> rayWeight, filterWeight;
+		std::vector<RayDifferential> cameraRay;
+		// Path throughput and radiance so far
+		std::vector<Spectrum> L, beta;
+		std::vector<RNG> rng;
+		std::vector<int> depth;
+		std::vector<uint8_t> specularBounce, onCameraRay;
+		// Previous scattering vertex and its BSDF pdf, for MIS of emission
+		std::vector<Point3f> prevP;
+		std::vector<Normal3f> prevN;
+		std::vector<Vector3f> prevPError;
+		std::vector<float> bsdfPdf;
+		std::vector<AOVSample> aov;
+		std::vector<SurfaceInteraction> isect;
+		// Stage queues
+		RayQueue rays, nextRays, shadowRays;
+		std::vector<Spectrum> shadowLd;
+		HitQueue hits;
+		void Resize(int n)
+		{
+			nPaths = n;
+			pixel.resize(n);
+			pFilm.resize(n);
+			rayWeight.resize(n);
+			filterWeight.resize(n);
+			cameraRay.resize(n);
+			L.resize(n);
+			beta.resize(n);
+			rng.resize(n);
+			depth.resize(n);
+			specularBounce.resize(n);
+			onCameraRay.resize(n);
+			prevP.resize(n);
+			prevN.resize(n);
+			prevPError.resize(n);
+			bsdfPdf.resize(n);
+			aov.resize(n);
+			isect.resize(n);
+			rays.Resize(n);
+			nextRays.Resize(n);
+			shadowRays.Resize(n);
+			shadowLd.resize(n);
+			hits.Resize(n);
+		}
+		Interaction PrevInteraction(int path, float time) const
+		{
+			return Interaction(prevP[path], prevN[path], prevPError[path],
+				Vector3f(0, 0, 0), time, MediumInterface());
+		}
+	};
+
+	WavefrontPathIntegrator::WavefrontPathIntegrator(int maxDepth,
+		std::shared_ptr<const Camera> camera, std::shared_ptr<Sampler> sampler,
+		int waveSize, const std::string& lightSampleStrategy)
+		: maxDepth(maxDepth), camera(std::move(camera)), sampler(std::move(sampler)),
+		  waveSize(std::max(1, waveSize)), lightSampleStrategy(lightSampleStrategy)
+	{}
+
+	void WavefrontPathIntegrator::Render(const Scene& scene)
+	{
+		lightDistribution = CreateLightSampleDistribution(lightSampleStrategy, scene);
+		lightToIndex.clear();
+		for (size_t i = 0; i < scene.lights.size(); ++i)
+			lightToIndex[scene.lights[i].get()] = int(i);
+		Film* film = camera->film;
+		Bounds2i sampleBounds = film->GetSampleBounds();
+		const int tileSize = 16;
+		const int spp = static_cast<int>(sampler->samplesPerPixel);
+		// Bands match SamplerIntegrator::Render() so that streaming films
+		// see the same sequence of completed rows
+		const int bandHeight = film->GetBandHeight() > 0 ?
+			film->GetBandHeight() : sampleBounds.Diagonal().y;
+		const uint32_t aovMask = film->GetAOVMask();
+		using Clock = std::chrono::steady_clock;
+		const int64_t writeIntervalMs = int64_t(1000 * PbrtOptions.writeInterval);
+		const Clock::time_point renderStart = Clock::now();
+		int64_t nextWriteMs = writeIntervalMs;
+
+		Wave wave;
+		int seed = 0;
+		for (int by = sampleBounds.pMin.y; by < sampleBounds.pMax.y; by += bandHeight)
+		{
+			int byEnd = std::min(by + bandHeight, sampleBounds.pMax.y);
+			std::vector<WaveTile> bandTiles;
+			for (int y0 = by; y0 < byEnd; y0 += tileSize)
+				for (int x0 = sampleBounds.pMin.x; x0 < sampleBounds.pMax.x; x0 += tileSize)
+				{
+					Bounds2i bounds(Point2i(x0, y0),
+						Point2i(std::min(x0 + tileSize, sampleBounds.pMax.x),
+							std::min(y0 + tileSize, byEnd)));
+					bandTiles.push_back({ bounds, seed++, 0, bounds.Area() * spp });
+				}
+
+			// Group consecutive tiles into waves of about _waveSize_ paths
+			for (size_t start = 0; start < bandTiles.size();)
+			{
+				std::vector<WaveTile> tiles;
+				int nPaths = 0;
+				while (start < bandTiles.size() && (tiles.empty() || nPaths < waveSize))
+				{
+					tiles.push_back(bandTiles[start++]);
+					tiles.back().firstPath = nPaths;
+					nPaths += tiles.back().nPaths;
+				}
+				++nWaves;
+				wave.Resize(nPaths);
+				for (int i = 0; i < nPaths; ++i)
+				{
+					wave.aov[i] = AOVSample();
+					wave.aov[i].requested = aovMask;
+				}
+
+				GenerateCameraRays(wave, tiles);
+				while (wave.rays.size > 0)
+				{
+					IntersectRays(scene, wave);
+					SortHitsByMaterial(wave);
+					ShadeHits(scene, wave);
+					TraceShadowRays(scene, wave);
+					wave.rays.Swap(wave.nextRays);
+				}
+				AddToFilm(wave, tiles);
+
+				if (writeIntervalMs > 0)
+				{
+					int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+						Clock::now() - renderStart).count();
+					if (elapsedMs >= nextWriteMs)
+					{
+						film->WriteImageAsync();
+						nextWriteMs = elapsedMs + writeIntervalMs;
+					}
+				}
+			}
+			film->FinishRows(byEnd);
+		}
+		film->WriteImage();
+	}
+
+	void WavefrontPathIntegrator::GenerateCameraRays(Wave& wave,
+		const std::vector<WaveTile>& tiles) const
+	{
+		const FilterSampler* filterSampler = camera->film->GetFilterSampler();
+		const int spp = static_cast<int>(sampler->samplesPerPixel);
+		ParallelFor([&](int64_t t) {
+			const WaveTile& tile = tiles[t];
+			// Camera samples come from the scene's sampler; the later
+			// dimensions of each path come from its own RNG stream
+			std::unique_ptr<Sampler> tileSampler(sampler->Clone(tile.seed));
+			int path = tile.firstPath;
+			for (Point2i pixel : tile.bounds)
+			{
+				tileSampler->StartPixel(pixel);
+				for (int s = 0; s < spp; ++s, ++path)
+				{
+					CameraSample cs = tileSampler->GetCameraSample(pixel, filterSampler);
+					wave.pixel[path] = pixel;
+					wave.pFilm[path] = cs.pFilm;
+					wave.filterWeight[path] = cs.filterWeight;
+					RayDifferential& ray = wave.cameraRay[path];
+					wave.rayWeight[path] = camera->GenerateRayDifferential(cs, &ray);
+					ray.ScaleDifferentials(1 / std::sqrt(float(spp)));
+					wave.rng[path].SetSequence((uint64_t(tile.seed) << 32) +
+						uint64_t(path - tile.firstPath));
+					wave.L[path] = Spectrum(0.f);
+					wave.beta[path] = Spectrum(1.f);
+					wave.depth[path] = 0;
+					wave.specularBounce[path] = false;
+					wave.onCameraRay[path] = true;
+					tileSampler->StartNextSample();
+				}
+			}
+			}, tiles.size());
+
+		// Queue the camera rays in path order
+		wave.rays.size = 0;
+		for (int path = 0; path < wave.nPaths; ++path)
+			if (wave.rayWeight[path] > 0)
+				wave.rays.Push(wave.cameraRay[path], path);
+	}
+
+	void WavefrontPathIntegrator::IntersectRays(const Scene& scene, Wave& wave) const
+	{
+		const int nRays = wave.rays.size;
+		wave.hits.size = 0;
+		ParallelFor([&](int64_t chunk) {
+			int end = std::min(nRays, int(chunk + 1) * QueueChunkSize);
+			for (int i = int(chunk) * QueueChunkSize; i < end; ++i)
+			{
+				int path = wave.rays.pathIndex[i];
+				Ray ray = wave.rays.Get(i);
+				SurfaceInteraction& isect = wave.isect[path];
+				isect = SurfaceInteraction();
+				bool found = scene.Intersect(ray, &isect);
+
+				// Add emission, weighted against light sampling at the
+				// previous vertex unless it could not have sampled it
+				const bool unweighted = wave.depth[path] == 0 || wave.specularBounce[path];
+				auto lightSelectPdf = [&](const Light* light) {
+					auto it = lightToIndex.find(light);
+					return it == lightToIndex.end() ? 0.f :
+						lightDistribution->PMF(wave.prevP[path], wave.prevN[path], it->second);
+				};
+				Spectrum Le(0.f);
+				if (found)
+				{
+					Le = isect.Le(-ray.d);
+					if (!Le.IsBlack() && !unweighted)
+					{
+						const AreaLight* area = isect.primitive->GetAreaLight();
+						float lightPdf = area ? lightSelectPdf(area) *
+							area->Pdf_Li(wave.PrevInteraction(path, ray.time), ray.d) : 0;
+						Le *= PowerHeuristic(1, wave.bsdfPdf[path], 1, lightPdf);
+					}
+				}
+				else
+					for (const auto& light : scene.lights)
+					{
+						Spectrum Ll = light->Le(RayDifferential(ray));
+						if (!Ll.IsBlack() && !unweighted)
+						{
+							float lightPdf = lightSelectPdf(light.get()) *
+								light->Pdf_Li(wave.PrevInteraction(path, ray.time), ray.d);
+							Ll *= PowerHeuristic(1, wave.bsdfPdf[path], 1, lightPdf);
+						}
+						Le += Ll;
+					}
+				wave.L[path] += wave.beta[path] * Le;
+
+				if (found && wave.depth[path] < maxDepth)
+					wave.hits.Push(path, isect.primitive->GetMaterial());
+			}
+			}, (nRays + QueueChunkSize - 1) / QueueChunkSize);
+	}
+
+	void WavefrontPathIntegrator::SortHitsByMaterial(Wave& wave) const
+	{
+		// Order by material, then by path so that the order of the queue
+		// does not depend on which thread pushed first
+		HitQueue& hits = wave.hits;
+		const int nHits = hits.size;
+		std::vector<int> order(nHits);
+		for (int i = 0; i < nHits; ++i)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](int a, int b) {
+			if (hits.material[a] != hits.material[b])
+				return std::less<const Material*>()(hits.material[a], hits.material[b]);
+			return hits.pathIndex[a] < hits.pathIndex[b];
+		});
+		std::vector<int> pathIndex(nHits);
+		std::vector<const Material*> material(nHits);
+		for (int i = 0; i < nHits; ++i)
+		{
+			pathIndex[i] = hits.pathIndex[order[i]];
+			material[i] = hits.material[order[i]];
+		}
+		std::copy(pathIndex.begin(), pathIndex.end(), hits.pathIndex.begin());
+		std::copy(material.begin(), material.end(), hits.material.begin());
+	}
+
+	void WavefrontPathIntegrator::ShadeHits(const Scene& scene, Wave& wave) const
+	{
+		const int nHits = wave.hits.size;
+		const int nLights = int(scene.lights.size());
+		wave.nextRays.size = 0;
+		wave.shadowRays.size = 0;
+		ParallelFor([&](int64_t chunk) {
+			MemoryArena& arena = PerThreadArena();
+			int end = std::min(nHits, int(chunk + 1) * QueueChunkSize);
+			for (int h = int(chunk) * QueueChunkSize; h < end; ++h)
+			{
+				int path = wave.hits.pathIndex[h];
+				SurfaceInteraction& isect = wave.isect[path];
+				RNG& rng = wave.rng[path];
+				// Only camera rays carry differentials for texture filtering
+				RayDifferential ray = wave.onCameraRay[path] ? wave.cameraRay[path] :
+					RayDifferential(isect.p, -isect.wo);
+				isect.ComputeScatteringFunctions(ray, arena, true);
+				if (!isect.bsdf)
+				{
+					// Continue through medium boundaries without a bounce
+					wave.nextRays.Push(isect.SpawnRay(-isect.wo), path);
+					wave.onCameraRay[path] = false;
+					arena.Reset();
+					continue;
+				}
+				if (wave.depth[path] == 0)
+					RecordAOVSample(&wave.aov[path], wave.cameraRay[path].o, isect);
+				const Spectrum& beta = wave.beta[path];
+
+				// Sample one light and queue a shadow ray for it
+				const BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+				if (nLights > 0)
+				{
+					float selectPdf;
+					int lightNum = lightDistribution->Sample(isect.p, isect.n,
+						rng.UniformFloat(), &selectPdf);
+					Point2f uLight(rng.UniformFloat(), rng.UniformFloat());
+					Vector3f wi;
+					float lightPdf = 0;
+					VisibilityTester visibility;
+					Spectrum Li(0.f);
+					if (lightNum >= 0)
+						Li = scene.lights[lightNum]->Sample_Li(isect, uLight, &wi,
+							&lightPdf, &visibility);
+					lightPdf *= selectPdf;
+					if (lightPdf > 0 && !Li.IsBlack())
+					{
+						Spectrum f = isect.bsdf->f(isect.wo, wi, bsdfFlags) *
+							AbsDot(wi, isect.shading.n);
+						if (!f.IsBlack())
+						{
+							float weight = IsDeltaLight(scene.lights[lightNum]->flags) ? 1 :
+								PowerHeuristic(1, lightPdf, 1,
+									isect.bsdf->Pdf(isect.wo, wi, bsdfFlags));
+							int s = wave.shadowRays.Push(
+								visibility.P0().SpawnRayTo(visibility.P1()), path);
+							wave.shadowLd[s] = beta * f * Li * weight / lightPdf;
+						}
+					}
+				}
+
+				// Sample the BSDF for the path's next direction
+				Vector3f wi;
+				float pdf;
+				BxDFType flags;
+				Point2f u(rng.UniformFloat(), rng.UniformFloat());
+				Spectrum f = isect.bsdf->Sample_f(isect.wo, &wi, u, &pdf, BSDF_ALL, &flags);
+				arena.Reset();
+				if (f.IsBlack() || pdf == 0.f)
+					continue;
+				Spectrum newBeta = beta * f * AbsDot(wi, isect.shading.n) / pdf;
+				int depth = ++wave.depth[path];
+				wave.specularBounce[path] = (flags & BSDF_SPECULAR) != 0;
+				wave.bsdfPdf[path] = pdf;
+				wave.prevP[path] = isect.p;
+				wave.prevN[path] = isect.n;
+				wave.prevPError[path] = isect.pError;
+				wave.onCameraRay[path] = false;
+
+				// Russian roulette, as in PathIntegrator
+				if (depth > 4)
+				{
+					float q = std::max((float).05, 1 - newBeta.y());
+					if (rng.UniformFloat() < q)
+						continue;
+					newBeta /= 1 - q;
+				}
+				wave.beta[path] = newBeta;
+				wave.nextRays.Push(isect.SpawnRay(wi), path);
+			}
+			}, (nHits + QueueChunkSize - 1) / QueueChunkSize);
+	}
+
+	void WavefrontPathIntegrator::TraceShadowRays(const Scene& scene, Wave& wave) const
+	{
+		// Each path has at most one shadow ray queued, so paths' radiance
+		// can be updated without synchronization
+		const int nRays = wave.shadowRays.size;
+		nShadowRays += nRays;
+		ParallelFor([&](int64_t chunk) {
+			int end = std::min(nRays, int(chunk + 1) * QueueChunkSize);
+			for (int i = int(chunk) * QueueChunkSize; i < end; ++i)
+				if (!scene.IntersectP(wave.shadowRays.Get(i)))
+					wave.L[wave.shadowRays.pathIndex[i]] += wave.shadowLd[i];
+			}, (nRays + QueueChunkSize - 1) / QueueChunkSize);
+	}
+
+	void WavefrontPathIntegrator::AddToFilm(const Wave& wave,
+		const std::vector<WaveTile>& tiles) const
+	{
+		Film* film = camera->film;
+		const bool filterSampling = film->GetFilterSampler() != nullptr;
+		const uint32_t aovMask = film->GetAOVMask();
+		std::vector<std::unique_ptr<FilmTile>> filmTiles(tiles.size());
+		ParallelFor([&](int64_t t) {
+			std::unique_ptr<FilmTile> filmTile = film->GetFilmTile(tiles[t].bounds);
+			for (int path = tiles[t].firstPath;
+			     path < tiles[t].firstPath + tiles[t].nPaths; ++path)
+			{
+				if (aovMask)
+					filmTile->AddAOVSample(wave.pixel[path], wave.aov[path]);
+				if (filterSampling)
+					filmTile->AddPixelSample(wave.pixel[path], wave.L[path],
+						wave.filterWeight[path], wave.rayWeight[path]);
+				else
+					filmTile->AddSample(wave.pFilm[path], wave.L[path], wave.rayWeight[path]);
+			}
+			filmTiles[t] = std::move(filmTile);
+			}, tiles.size());
+		// Merge in tile order so the image does not depend on thread timing
+		for (std::unique_ptr<FilmTile>& filmTile : filmTiles)
+			film->MergeFilmTile(std::move(filmTile));
+	}
+
+	WavefrontPathIntegrator* CreateWavefrontPathIntegrator(const ParamSet& params,
+		std::shared_ptr<Sampler> sampler,
+		std::shared_ptr<const Camera> camera)
+	{
+		int maxDepth = params.FindOneInt("maxdepth", 5);
+		int waveSize = params.FindOneInt("wavesize", 1 << 16);
+		std::string lightStrategy =
+			params.FindOneString("lightsamplestrategy", "spatial");
+		return new WavefrontPathIntegrator(maxDepth, camera, sampler, waveSize,
+			lightStrategy);
+	}
+}
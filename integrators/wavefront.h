@@ -0,0 +1,48 @@
+#ifndef PBRT_INTEGRATORS_WAVEFRONT_H
+#define PBRT_INTEGRATORS_WAVEFRONT_H
+
+#include "core/integrator.h"
+#include "core/lightdistrib.h"
+#include <unordered_map>
+
+namespace pbrt
+{
+	// Path tracer that advances a whole wave of paths one stage at a time:
+	// camera ray generation, intersection, sorting hits by material, shading
+	// with next-event estimation, and tracing the resulting shadow rays. Each
+	// stage runs over structure-of-arrays queues in parallel.
+	class WavefrontPathIntegrator : public Integrator
+	{
+	public:
+		WavefrontPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+			std::shared_ptr<Sampler> sampler, int waveSize,
+			const std::string& lightSampleStrategy = "spatial");
+		void Render(const Scene& scene) override;
+	private:
+		struct Wave;
+		struct WaveTile;
+		void GenerateCameraRays(Wave& wave, const std::vector<WaveTile>& tiles) const;
+		void IntersectRays(const Scene& scene, Wave& wave) const;
+		void SortHitsByMaterial(Wave& wave) const;
+		void ShadeHits(const Scene& scene, Wave& wave) const;
+		void TraceShadowRays(const Scene& scene, Wave& wave) const;
+		void AddToFilm(const Wave& wave, const std::vector<WaveTile>& tiles) const;
+
+		const int maxDepth;
+		std::shared_ptr<const Camera> camera;
+		std::shared_ptr<Sampler> sampler;
+		// Number of paths in flight, rounded up to whole tiles
+		const int waveSize;
+		const std::string lightSampleStrategy;
+		// Built by Render(); emission found by BSDF sampling is weighted
+		// with the probability of having picked its light instead
+		std::shared_ptr<const LightDistribution> lightDistribution;
+		std::unordered_map<const Light*, int> lightToIndex;
+	};
+
+	WavefrontPathIntegrator* CreateWavefrontPathIntegrator(const ParamSet& params,
+		std::shared_ptr<Sampler> sampler,
+		std::shared_ptr<const Camera> camera);
+}
+
+#endif
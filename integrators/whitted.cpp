@@ -7,7 +7,7 @@
 
 using namespace pbrt;
 
-Spectrum WhittedIntegrator::Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const
+Spectrum WhittedIntegrator::Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth, AOVSample* aov) const
 {
 	Spectrum L(0.);
 	// Find closest ray intersection or return background radiance
@@ -25,6 +25,7 @@ Spectrum WhittedIntegrator::Li(const RayDifferential& ray, const Scene& scene, S
 	Vector3f wo = isect.wo;
 	// Compute scattering functions for surface interaction
 	isect.ComputeScatteringFunctions(ray, arena);
+	RecordAOVSample(aov, ray.o, isect);
 	// Compute emitted light if ray hit an area light source
 	L += isect.Le(wo);
 	// Add contribution of each light source
@@ -9,7 +9,7 @@ namespace pbrt
 	class WhittedIntegrator : public SamplerIntegrator
 	{
 	public:
-		Spectrum Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const override;
+		Spectrum Li(const RayDifferential& ray, const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth, AOVSample* aov) const override;
 	private:
 		const int maxDepth;
 	};
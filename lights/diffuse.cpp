@@ -1,6 +1,7 @@
 #include "diffuse.h"
 
 #include "core/paramset.h"
+#include "core/sampling.h"
 #include "core/shape.h"
 
 namespace pbrt
@@ -32,6 +33,32 @@ namespace pbrt
 	{
 		return shape->Pdf(ref, wi);
 	}
+	Spectrum DiffuseAreaLight::Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+		Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const
+	{
+		// Pick a point uniformly on the shape and a cosine-weighted
+		// direction around its normal
+		Interaction pShape = shape->Sample(u1);
+		pShape.time = time;
+		pShape.mediumInterface = mediumInterface;
+		*pdfPos = shape->Pdf(pShape);
+		*nLight = pShape.n;
+		Vector3f w = CosineSampleHemisphere(u2);
+		*pdfDir = CosineHemispherePdf(w.z);
+		Vector3f n(pShape.n), v1, v2;
+		CoordinateSystem(n, &v1, &v2);
+		w = w.x * v1 + w.y * v2 + w.z * n;
+		*ray = pShape.SpawnRay(w);
+		return L(pShape, w);
+	}
+	bool DiffuseAreaLight::GetBounds(LightBounds* bounds) const
+	{
+		// Emission covers the hemisphere around each normal
+		DirectionCone nb = shape->NormalBounds();
+		*bounds = LightBounds(shape->WorldBound(), nb.w, Pi * Lemit.y() * area,
+			nb.cosTheta, std::cos(Pi / 2), false);
+		return true;
+	}
 
 	std::shared_ptr<AreaLight> CreateDiffuseAreaLight(const Transform& light2world, const Medium* medium,
 		const ParamSet& paramSet, const std::shared_ptr<Shape>& shape)
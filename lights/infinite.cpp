@@ -66,6 +66,32 @@ namespace pbrt
 		return distribution->Pdf(Point2f(phi * Inv2Pi, theta * InvPi)) /
 			(2 * Pi * Pi * sinTheta);
 	}
+	Spectrum InfiniteAreaLight::Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+		Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const
+	{
+		// Pick a direction from the environment map, then an origin on a
+		// disk facing it just outside the scene's bounding sphere
+		float mapPdf;
+		Point2f uv = distribution->SampleContinuous(u1, &mapPdf);
+		if (mapPdf == 0)
+		{
+			*pdfPos = *pdfDir = 0;
+			return { 0 };
+		}
+		float theta = uv[1] * Pi, phi = uv[0] * 2 * Pi;
+		float cosTheta = std::cos(theta), sinTheta = std::sin(theta);
+		float cosPhi = std::cos(phi), sinPhi = std::sin(phi);
+		Vector3f d = -LightToWorld(Vector3f(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta));
+		*nLight = Normal3f(d);
+		Vector3f v1, v2;
+		CoordinateSystem(-d, &v1, &v2);
+		Point2f cd = ConcentricSampleDisk(u2);
+		Point3f pDisk = worldCenter + worldRadius * (cd.x * v1 + cd.y * v2);
+		*ray = Ray(pDisk + worldRadius * -d, d, Infinity, time);
+		*pdfDir = sinTheta == 0 ? 0 : mapPdf / (2 * Pi * Pi * sinTheta);
+		*pdfPos = 1 / (Pi * worldRadius * worldRadius);
+		return { Lmap->Lookup(uv), SpectrumType::Illuminant };
+	}
 	void InfiniteAreaLight::Preprocess(const Scene& scene)
 	{
 		scene.Worldbound().BoundingSphere(&worldCenter, &worldRadius);
@@ -14,6 +14,8 @@ namespace pbrt
 		                  const Spectrum& L, int nSamples, const std::string& texmap);
 		Spectrum Sample_Li(const Interaction& ref, const Point2f& u, Vector3f* wi, float* pdf, VisibilityTester* vis) const override;
 		float Pdf_Li(const Interaction& ref, const Vector3f& wi) const override;
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+			Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const override;
 		void Preprocess(const Scene& scene) override;
 		Spectrum Power() const override;
 		Spectrum Le(const RayDifferential& ray) const override;
@@ -1,5 +1,6 @@
 #include "point.h"
 #include "core/paramset.h"
+#include "core/sampling.h"
 
 namespace pbrt
 {
@@ -22,6 +23,21 @@ namespace pbrt
 	{
 		return 0.0f;
 	}
+	Spectrum PointLight::Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+		Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const
+	{
+		*ray = Ray(pLight, UniformSampleSphere(u1), Infinity, time, mediumInterface.inside);
+		*nLight = Normal3f(ray->d);
+		*pdfPos = 1;
+		*pdfDir = UniformSpherePdf();
+		return I;
+	}
+	bool PointLight::GetBounds(LightBounds* bounds) const
+	{
+		*bounds = LightBounds(Bounds3f(pLight), Vector3f(0, 0, 1), 4 * Pi * I.y(), std::cos(Pi),
+			std::cos(Pi / 2), false);
+		return true;
+	}
 
     std::shared_ptr<PointLight> CreatePointLight(const Transform &lightToWorld, const Medium *medium, const ParamSet &paramSet)
     {
@@ -13,6 +13,9 @@ namespace pbrt
 		Spectrum Sample_Li(const Interaction& ref, const Point2f& u, Vector3f* wi, float* pdf,
 			VisibilityTester* vis) const override;
 		float Pdf_Li(const Interaction& ref, const Vector3f& wi) const override;
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+			Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const override;
+		bool GetBounds(LightBounds* bounds) const override;
 	private:
 		const Point3f pLight;
 		const Spectrum I;
@@ -1,5 +1,6 @@
 #include "spot.h"
 #include "core/paramset.h"
+#include "core/sampling.h"
 
 namespace pbrt
 {
@@ -38,6 +39,27 @@ namespace pbrt
 		return 0.f;
 	}
 
+	Spectrum SpotLight::Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+		Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const
+	{
+		Vector3f w = UniformSampleCone(u1, cosTotalWidth);
+		*ray = Ray(pLight, LightToWorld(w), Infinity, time, mediumInterface.inside);
+		*nLight = Normal3f(ray->d);
+		*pdfPos = 1;
+		*pdfDir = UniformConePdf(cosTotalWidth);
+		return I * Falloff(ray->d);
+	}
+
+	bool SpotLight::GetBounds(LightBounds* bounds) const
+	{
+		// Full intensity within the falloff start; the falloff region
+		// widens the cone of emission
+		float cosThetaE = std::cos(std::acos(cosTotalWidth) - std::acos(cosFalloffstart));
+		*bounds = LightBounds(Bounds3f(pLight), LightToWorld(Vector3f(0, 0, 1)), 4 * Pi * I.y(),
+			cosFalloffstart, cosThetaE, false);
+		return true;
+	}
+
 	std::shared_ptr<SpotLight> CreateSpotLight(const Transform& lightToWorld, const Medium* medium,
 	                                           const ParamSet& paramSet)
 	{
@@ -12,8 +12,11 @@ namespace pbrt
 			, const Spectrum& I, float totalWidth, float falloffStart);
 		Spectrum Sample_Li(const Interaction& ref, const Point2f& u, Vector3f* wi, float* pdf, VisibilityTester* vis) const override;
 		float Pdf_Li(const Interaction& ref, const Vector3f& wi) const override;
+		Spectrum Sample_Le(const Point2f& u1, const Point2f& u2, float time,
+			Ray* ray, Normal3f* nLight, float* pdfPos, float* pdfDir) const override;
 		float Falloff(const Vector3f& w) const;
 		Spectrum Power() const override;
+		bool GetBounds(LightBounds* bounds) const override;
 		~SpotLight() = default;
 	private:
 		const Point3f pLight;
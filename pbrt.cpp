@@ -27,6 +27,30 @@ int main(int argc, char* argv[])
 				//usage("missing value after --nthreads argument");
 				options.nThreads = atoi(argv[++i]);
 		}
+		else if (!strcmp(argv[i], "--prefault") || !strcmp(argv[i], "-prefault"))
+			options.prefaultMemory = true;
+		else if (!strcmp(argv[i], "--deterministic") || !strcmp(argv[i], "-deterministic"))
+			options.deterministic = true;
+		else if (!strcmp(argv[i], "--writeinterval") || !strcmp(argv[i], "-writeinterval")) {
+			if (i + 1 < argc)
+				options.writeInterval = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--adaptive") || !strcmp(argv[i], "-adaptive")) {
+			if (i + 1 < argc)
+				options.adaptiveThreshold = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--timebudget") || !strcmp(argv[i], "-timebudget")) {
+			if (i + 1 < argc)
+				options.timeBudget = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--writepasses") || !strcmp(argv[i], "-writepasses"))
+			options.writePasses = true;
+		else if (!strcmp(argv[i], "--checkpoint") || !strcmp(argv[i], "-checkpoint")) {
+			if (i + 1 < argc)
+				options.checkpointInterval = atof(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--resume") || !strcmp(argv[i], "-resume"))
+			options.resume = true;
 		else
 			fileNames.push_back(argv[i]);
 	}
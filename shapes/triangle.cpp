@@ -336,6 +336,33 @@ namespace pbrt
         return 0.5 * Cross(p1 - p0, p2 - p0).Length();
     }
 
+    DirectionCone Triangle::NormalBounds() const
+    {
+        // Orient the cone as Sample() orients _it.n_, since that is the
+        // side area lights emit from
+        if (mesh->n)
+        {
+            // Sample() interpolates the vertex normals, which stays within
+            // a cone around all three while that cone is convex
+            DirectionCone cone;
+            for (int i = 0; i < 3; ++i)
+            {
+                Vector3f n(mesh->n[v[i]]);
+                if (n.LengthSquared() == 0)
+                    return DirectionCone::EntireSphere();
+                cone = Union(cone, DirectionCone(reverseOrientation ? -n : n));
+            }
+            return cone.cosTheta > 0 ? cone : DirectionCone::EntireSphere();
+        }
+        const Point3f& p0 = mesh->p[v[0]];
+        const Point3f& p1 = mesh->p[v[1]];
+        const Point3f& p2 = mesh->p[v[2]];
+        Vector3f n = Cross(p1 - p0, p2 - p0);
+        if (n.LengthSquared() == 0)
+            return DirectionCone::EntireSphere();
+        return DirectionCone(reverseOrientation ? -n : n);
+    }
+
     bool Triangle::IntersectP(const Ray &ray, bool testAlphaTexture) const
     {
         return Shape::IntersectP(ray, testAlphaTexture);
@@ -36,6 +36,7 @@ namespace pbrt
 		bool IntersectP(const Ray& ray, bool testAlphaTexture) const override;
 		float Area() const override;
 		Interaction Sample(const Point2f& u) const override;
+		DirectionCone NormalBounds() const override;
 	private:
 		void GetUVs(Point2f uv[3]) const
 		{